@@ -0,0 +1,373 @@
+#include <cstring>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "async.h"
+#include "fs.h"
+#include "trace.h"
+
+// fire-and-forget coroutine that runs a spawned task to completion and
+// frees itself
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+EventLoop::EventLoop() : live(0)
+{
+    event_fd = ::eventfd(0, EFD_CLOEXEC);
+}
+
+EventLoop::~EventLoop()
+{
+    ::close(event_fd);
+}
+
+void
+EventLoop::post(std::coroutine_handle<> h)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        ready.push_back(h);
+    }
+    uint64_t one = 1;
+    ssize_t n = ::write(event_fd, &one, sizeof(one));
+    (void)n;
+}
+
+Detached
+EventLoop::detach(EventLoop *loop, Task t, int *result)
+{
+    int ret = co_await t;
+    if (result) {
+        *result = ret;
+    }
+    loop->live--;
+}
+
+void
+EventLoop::spawn(Task t, int *result)
+{
+    live++;
+    detach(this, std::move(t), result);
+}
+
+int
+EventLoop::poll()
+{
+    std::deque<std::coroutine_handle<> > batch;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        batch.swap(ready);
+    }
+    for (size_t i = 0; i < batch.size(); i++) {
+        batch[i].resume();
+    }
+    return batch.size();
+}
+
+void
+EventLoop::run()
+{
+    while (live > 0) {
+        if (poll() == 0) {
+            // sleeps until an I/O thread posts a completion
+            uint64_t n;
+            ssize_t got = ::read(event_fd, &n, sizeof(n));
+            (void)got;
+        }
+    }
+}
+
+void
+IOAwaitable::await_suspend(std::coroutine_handle<> h)
+{
+    req.waiter = h;
+    disk->submit(&req);
+}
+
+AsyncDisk::AsyncDisk(BlockCache &disk, IOStats *stats, EventLoop &loop, int nthreads)
+    : disk(disk), stats(stats), loop(loop), stop(false)
+{
+    for (int i = 0; i < nthreads; i++) {
+        threads.push_back(std::thread(&AsyncDisk::worker, this));
+    }
+}
+
+AsyncDisk::~AsyncDisk()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stop = true;
+    }
+    cond.notify_all();
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+}
+
+void
+AsyncDisk::submit(io_request *r)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        queue.push_back(r);
+    }
+    cond.notify_one();
+}
+
+void
+AsyncDisk::worker()
+{
+    while (true) {
+        io_request *r;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            while (!stop && queue.empty()) {
+                cond.wait(guard);
+            }
+            if (queue.empty()) {
+                return;
+            }
+            r = queue.front();
+            queue.pop_front();
+        }
+        if (r->write) {
+            if (stats) stats->write(BLK_DATA);
+            r->result = disk.write(r->blk, r->buf);
+        } else {
+            if (stats) stats->read(BLK_DATA);
+            r->result = disk.read(r->blk, r->buf);
+        }
+        loop.post(r->waiter);
+    }
+}
+
+AsyncFS::AsyncFS(FS &fs, EventLoop &loop, int io_threads)
+    : fs(fs), disk(fs.cache, &fs.counters, loop, io_threads)
+{
+}
+
+// dir_lock is never held across a co_await: the loop thread would block
+// every other coroutine on it
+
+Task
+AsyncFS::create_async(std::string filepath, const char *data, uint32_t size)
+{
+    OpTimer timer(fs.counters, OP_CREATE);
+    if (fs.recorder) fs.recorder->record(OP_CREATE, filepath, "", size);
+
+    int ret = fs.check_new(filepath);
+    if (ret != 0) {
+        co_return ret;
+    }
+    // duplicates and delayed files are settled as by create, without I/O
+    FS::new_file f;
+    ret = fs.begin_file(filepath, data, size, f);
+    if (ret != 0 || f.done) {
+        co_return ret;
+    }
+    std::string packed;
+    if (f.type & TYPE_COMPRESSED) {
+        FS::pack(data, size, packed);
+    }
+    const char *stored = (f.type & TYPE_COMPRESSED) ? packed.data() : data;
+    uint32_t len = (f.type & TYPE_COMPRESSED) ? packed.size() : size;
+
+    uint16_t first_blk = 0;
+    int prev = -1;
+    unsigned holes = 0;
+    uint8_t data_block[BLOCK_SIZE];
+    for (uint32_t done = 0; done < len; done += BLOCK_SIZE) {
+        if (FS::skip_block(stored + done, done, len, holes)) {
+            holes++;
+            continue;
+        }
+        int b = fs.alloc_block(prev);
+        if (b == -1) {
+            fs.free_chain(first_blk);
+            co_return -5;
+        }
+        if (first_blk == 0) {
+            first_blk = static_cast<uint16_t>(b);
+        }
+        if (prev != -1) {
+            fs.set_fat(prev, static_cast<int16_t>(MAKE_LINK(b, holes)));
+        }
+        holes = 0;
+        uint32_t n = len - done < BLOCK_SIZE ? len - done : BLOCK_SIZE;
+        std::memset(data_block, 0, BLOCK_SIZE);
+        std::memcpy(data_block, stored + done, n);
+        if (co_await disk.write(b, data_block) != 0) {
+            fs.free_chain(first_blk);
+            co_return -6;
+        }
+        prev = b;
+    }
+    fs.counters.data_written(len);
+    co_return fs.finish_file(filepath, size, first_blk, f);
+}
+
+Task
+AsyncFS::read_async(std::string filepath, char *buf, uint32_t len, uint32_t offset)
+{
+    OpTimer timer(fs.counters, OP_READ);
+    if (fs.recorder) fs.recorder->record(OP_READ, filepath, std::to_string(offset), len);
+
+    dir_entry e;
+    {
+        std::lock_guard<std::mutex> guard(fs.dir_lock);
+        dir_entry *entries = reinterpret_cast<dir_entry*>(fs.root);
+        int index = fs.find_entry(entries, filepath);
+        if (index == -1) {
+            co_return -2;
+        }
+        // delayed files get their blocks first
+        fs.flush_pending(index);
+        e = entries[index];
+        if ((e.type & TYPE_MASK) != TYPE_FILE) {
+            co_return -3;
+        }
+        if (offset >= e.size || len == 0) {
+            co_return 0;
+        }
+        fs.pin(e.first_blk);
+    }
+    uint32_t n = e.size - offset;
+    if (n > len) n = len;
+    if (e.type & TYPE_COMPRESSED) {
+        // chunks are decompressed synchronously
+        int ret = fs.read_data(e, buf, n, offset);
+        fs.unpin(e.first_blk);
+        if (ret != 0) {
+            co_return ret;
+        }
+        fs.counters.data_read(n);
+        co_return n;
+    }
+
+    ChainCursor c(fs.fat, e.first_blk);
+    for (uint32_t skip = offset / BLOCK_SIZE; skip > 0; skip--) {
+        c.next();
+    }
+    uint32_t pos = offset % BLOCK_SIZE;
+    uint32_t done = 0;
+    uint32_t k = offset / BLOCK_SIZE;
+    uint32_t nblocks = (e.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint8_t data_block[BLOCK_SIZE];
+    int ret = 0;
+
+    while (done < n) {
+        int block = c.block();
+        uint32_t chunk = BLOCK_SIZE - pos;
+        if (chunk > n - done) chunk = n - done;
+        fs.readahead(e.first_blk, k++, nblocks, c);
+        if (block == HOLE_BLOCK) {
+            std::memset(buf + done, 0, chunk);
+            done += chunk;
+            pos = 0;
+            c.next();
+            continue;
+        }
+        if (block < (int)FIRST_DATA_BLOCK) {
+            ret = -4;
+            break;
+        }
+        // whole blocks go straight to the caller's buffer
+        uint8_t *dst = chunk == BLOCK_SIZE ? reinterpret_cast<uint8_t*>(buf + done) : data_block;
+        if (co_await disk.read(block, dst) != 0) {
+            ret = -4;
+            break;
+        }
+        if (dst == data_block) {
+            std::memcpy(buf + done, data_block + pos, chunk);
+        }
+        done += chunk;
+        pos = 0;
+        c.next();
+    }
+    fs.unpin(e.first_blk);
+    if (ret != 0) {
+        co_return ret;
+    }
+    fs.counters.data_read(n);
+    co_return n;
+}
+
+Task
+AsyncFS::cp_async(std::string sourcepath, std::string destpath)
+{
+    OpTimer timer(fs.counters, OP_CP);
+    if (fs.recorder) fs.recorder->record(OP_CP, sourcepath, destpath);
+
+    dir_entry src;
+    {
+        std::lock_guard<std::mutex> guard(fs.dir_lock);
+        dir_entry *entries = reinterpret_cast<dir_entry*>(fs.root);
+        int src_i = fs.find_entry(entries, sourcepath);
+        if (src_i == -1) co_return -2;
+        if (fs.find_entry(entries, destpath) != -1) co_return -3;
+        if (fs.free_entry() == -1) co_return -4;
+        fs.flush_pending(src_i);
+        if (fs.dedup && entries[src_i].first_blk != 0) {
+            // the copy shares the chain of the source, nothing to wait for
+            const dir_entry &e = entries[src_i];
+            fs.link_entry(fs.free_entry(), destpath, e.size, e.first_blk,
+                          e.access_rights, e.type);
+            fs.counters.data_deduped(e.size);
+            fs.store_dir();
+            co_return 0;
+        }
+        // the source is pinned so its chain cannot change while we copy
+        src = entries[src_i];
+        fs.pin(src.first_blk);
+    }
+
+    // a compressed file is copied as stored, its whole chain
+    std::vector<int> blocks;
+    fs.chain_blocks(src.first_blk,
+                    (src.type & TYPE_COMPRESSED) ? FSGeometry::max_file_size : src.size, blocks);
+
+    uint16_t new_first = 0;
+    int prev = -1;
+    unsigned holes = 0;
+    int ret = 0;
+    uint8_t data_block[BLOCK_SIZE];
+
+    for (size_t k = 0; k < blocks.size(); k++) {
+        if (blocks[k] == HOLE_BLOCK) {
+            holes++;
+            continue;
+        }
+        if (co_await disk.read(blocks[k], data_block) != 0) {
+            ret = -6;
+            break;
+        }
+        int nb = fs.alloc_block(prev);
+        if (nb == -1) {
+            ret = -5;
+            break;
+        }
+        if (new_first == 0) new_first = nb;
+        if (prev != -1) fs.set_fat(prev, MAKE_LINK(nb, holes));
+        holes = 0;
+        prev = nb;
+        if (co_await disk.write(nb, data_block) != 0) {
+            ret = -6;
+            break;
+        }
+    }
+    fs.unpin(src.first_blk);
+    if (ret != 0) {
+        fs.free_chain(new_first);
+        co_return ret;
+    }
+
+    fs.counters.data_read(src.size);
+    fs.counters.data_written(src.size);
+    co_return fs.add_entry(destpath, src.size, new_first, src.access_rights, src.type);
+}
@@ -0,0 +1,167 @@
+#include <cstdint>
+#include <string>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <coroutine>
+#include "cache.h"
+#include "stats.h"
+
+#ifndef __ASYNC_H__
+#define __ASYNC_H__
+
+// Awaitable FS API. Needs C++20 and is only compiled into programs that use
+// it, the rest of the tree stays C++11.
+//
+//   EventLoop loop;
+//   AsyncFS afs(fs, loop);
+//   loop.spawn(afs.cp_async("a", "b"));
+//   loop.run();
+//
+// Coroutines run on the thread that calls run(). Block I/O is handed to a
+// small pool of I/O threads, and the coroutine waiting for it is resumed on
+// the loop thread once it completes, so many operations can be in flight on
+// one thread. Metadata updates stay synchronous, they only touch memory and
+// write the FAT and directory blocks.
+//
+// Synchronous FS calls that wait for a pinned file (rm, append) must not be
+// made on the loop thread while an async operation on that file is running.
+
+class FS;
+struct Detached;
+
+// A lazily started coroutine returning an int, the return value of the FS
+// operation. co_await starts it and resumes the awaiting coroutine when it
+// finishes.
+class Task {
+public:
+    struct promise_type;
+    typedef std::coroutine_handle<promise_type> handle;
+
+    struct promise_type {
+        int value = 0;
+        std::coroutine_handle<> continuation;
+
+        Task get_return_object() { return Task(handle::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        struct final_awaiter {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(handle h) noexcept
+            {
+                std::coroutine_handle<> c = h.promise().continuation;
+                return c ? c : std::noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+        final_awaiter final_suspend() noexcept { return {}; }
+        void return_value(int v) { value = v; }
+        // the FS reports errors as return values
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    Task(Task &&t) noexcept : h(t.h) { t.h = nullptr; }
+    Task(const Task &) = delete;
+    ~Task() { if (h) h.destroy(); }
+
+    bool await_ready() { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> c)
+    {
+        h.promise().continuation = c;
+        return h;
+    }
+    int await_resume() { return h.promise().value; }
+
+private:
+    explicit Task(handle h) : h(h) {}
+    handle h;
+};
+
+// Resumes coroutines on the thread that calls run() or poll(). fd() becomes
+// readable whenever there is work, so the loop can also be driven from an
+// existing epoll loop by calling poll().
+class EventLoop {
+public:
+    EventLoop();
+    ~EventLoop();
+    // queues <h> to be resumed on the loop thread, callable from any thread
+    void post(std::coroutine_handle<> h);
+    // starts <t> now; it runs detached and stores its result in <result>
+    void spawn(Task t, int *result = nullptr);
+    // resumes coroutines until every spawned task has finished
+    void run();
+    // resumes the coroutines that are ready, returns how many
+    int poll();
+    int fd() const { return event_fd; }
+
+private:
+    int event_fd;
+    std::mutex lock;
+    std::deque<std::coroutine_handle<> > ready;
+    int live; // spawned tasks that have not finished, loop thread only
+
+    static Detached detach(EventLoop *loop, Task t, int *result);
+};
+
+struct io_request {
+    bool write;
+    int blk;
+    uint8_t *buf;
+    int result;
+    std::coroutine_handle<> waiter;
+};
+
+class AsyncDisk;
+
+// co_await yields the return value of BlockCache::read or BlockCache::write
+struct IOAwaitable {
+    AsyncDisk *disk;
+    io_request req;
+
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> h);
+    int await_resume() { return req.result; }
+};
+
+// Runs block reads and writes on a pool of I/O threads and posts the
+// waiting coroutine back to the loop when the transfer is done. Transfers
+// are counted as data blocks in <stats>.
+class AsyncDisk {
+public:
+    AsyncDisk(BlockCache &disk, IOStats *stats, EventLoop &loop, int threads);
+    ~AsyncDisk();
+    IOAwaitable read(int blk, uint8_t *buf) { return IOAwaitable{this, {false, blk, buf, 0, {}}}; }
+    IOAwaitable write(int blk, uint8_t *buf) { return IOAwaitable{this, {true, blk, buf, 0, {}}}; }
+    void submit(io_request *r);
+
+private:
+    BlockCache &disk;
+    IOStats *stats;
+    EventLoop &loop;
+    std::vector<std::thread> threads;
+    std::mutex lock;
+    std::condition_variable cond;
+    std::deque<io_request*> queue;
+    bool stop;
+
+    void worker();
+};
+
+// Awaitable versions of the FS calls that move file data. They return the
+// same values as their synchronous counterparts; read_async returns the
+// number of bytes copied like FS::read.
+class AsyncFS {
+public:
+    AsyncFS(FS &fs, EventLoop &loop, int io_threads = 4);
+
+    Task create_async(std::string filepath, const char *data, uint32_t size);
+    Task read_async(std::string filepath, char *buf, uint32_t len, uint32_t offset = 0);
+    Task cp_async(std::string sourcepath, std::string destpath);
+
+private:
+    FS &fs;
+    AsyncDisk disk;
+};
+
+#endif // __ASYNC_H__
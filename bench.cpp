@@ -0,0 +1,214 @@
+// Benchmark harness for the FS operations. Every operation is timed over a
+// range of file sizes and root directory fill levels, and one CSV row is
+// printed per combination:
+//
+//   op,size,fill,iters,ops_per_sec,mb_per_sec,p50_us,p99_us,reads_per_op,writes_per_op
+//
+// Usage: bench [-i image] [op ...]   (default: all of create cat cp mv rm append)
+//
+// Without -i the runs use a scratch image that is removed afterwards.
+#include <iostream>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include "fs.h"
+
+// stream buffer that throws away everything written to it
+class NullBuffer : public std::streambuf {
+protected:
+    int overflow(int c) { return c; }
+    std::streamsize xsputn(const char *, std::streamsize n) { return n; }
+};
+
+struct result {
+    int iters;
+    double seconds;
+    std::vector<double> latencies; // microseconds per operation
+    uint64_t reads;
+    uint64_t writes;
+};
+
+// largest file that fits on an empty volume
+#define MAX_FILE ((uint32_t)FSGeometry::max_file_size)
+// bytes moved per measurement, the iteration count is derived from it
+#define BYTES_PER_RUN (64 * 1024 * 1024)
+#define MAX_ITERS 500
+#define MIN_ITERS 5
+
+static std::string
+make_data(uint32_t size)
+{
+    std::string data(size, 'x');
+    for (size_t i = 60; i < data.size(); i += 61) {
+        data[i] = '\n';
+    }
+    return data;
+}
+
+// fills the root directory with <fill> empty files
+static void
+prepare(FS &fs, int fill)
+{
+    fs.format();
+    for (int i = 0; i < fill; i++) {
+        fs.create("fill" + std::to_string(i), "", 0);
+    }
+}
+
+typedef std::chrono::steady_clock clk;
+
+// times <op> <iters> times, <setup> and <teardown> run untimed around it
+template <typename Setup, typename Op, typename Teardown>
+static bool
+measure(FS &fs, int iters, result &r, Setup setup, Op op, Teardown teardown)
+{
+    r.iters = iters;
+    r.seconds = 0;
+    r.latencies.clear();
+    r.reads = r.writes = 0;
+    for (int i = 0; i < iters; i++) {
+        setup(i);
+        fs_stats before, after;
+        fs.stats(before);
+        clk::time_point start = clk::now();
+        int ret = op(i);
+        std::chrono::duration<double> t = clk::now() - start;
+        fs.stats(after);
+        for (int c = 0; c < BLK_CLASSES; c++) {
+            r.reads += after.reads[c] - before.reads[c];
+            r.writes += after.writes[c] - before.writes[c];
+        }
+        if (ret != 0) {
+            return false;
+        }
+        r.seconds += t.count();
+        r.latencies.push_back(t.count() * 1e6);
+        teardown(i);
+    }
+    return true;
+}
+
+static double
+percentile(std::vector<double> v, double p)
+{
+    if (v.empty()) {
+        return 0;
+    }
+    std::sort(v.begin(), v.end());
+    size_t i = (size_t)(p * (v.size() - 1) + 0.5);
+    return v[i];
+}
+
+static bool
+run(FS &fs, const std::string &op, uint32_t size, int fill, result &r)
+{
+    std::string data = make_data(size);
+    int iters = size ? BYTES_PER_RUN / size : MAX_ITERS;
+    iters = std::max(MIN_ITERS, std::min(MAX_ITERS, iters));
+    auto none = [](int) {};
+
+    prepare(fs, fill);
+    if (op == "create") {
+        return measure(fs, iters, r, none,
+            [&](int) { return fs.create("a", data.data(), size); },
+            [&](int) { fs.rm("a"); });
+    }
+    if (op == "rm") {
+        return measure(fs, iters, r,
+            [&](int) { fs.create("a", data.data(), size); },
+            [&](int) { return fs.rm("a"); }, none);
+    }
+    if (fs.create("a", data.data(), size) != 0) {
+        return false;
+    }
+    if (op == "cat") {
+        return measure(fs, iters, r, none,
+            [&](int) { return fs.cat("a"); }, none);
+    }
+    if (op == "cp") {
+        return measure(fs, iters, r, none,
+            [&](int) { return fs.cp("a", "b"); },
+            [&](int) { fs.rm("b"); });
+    }
+    if (op == "mv") {
+        return measure(fs, iters, r, none,
+            [&](int i) { return i % 2 ? fs.mv("b", "a") : fs.mv("a", "b"); },
+            none);
+    }
+    if (op == "append") {
+        return measure(fs, iters, r,
+            [&](int) { fs.create("b", "", 0); },
+            [&](int) { return fs.append("a", "b"); },
+            [&](int) { fs.rm("b"); });
+    }
+    return false;
+}
+
+int
+main(int argc, char **argv)
+{
+    std::vector<std::string> ops;
+    std::string image;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            image = argv[++i];
+        } else {
+            ops.push_back(argv[i]);
+        }
+    }
+    if (ops.empty()) {
+        ops = { "create", "cat", "cp", "mv", "rm", "append" };
+    }
+    const uint32_t sizes[] = { 0, 100, BLOCK_SIZE, 16 * BLOCK_SIZE,
+                               256 * BLOCK_SIZE, MAX_FILE / 2, MAX_FILE };
+    const int dir_entries = FSGeometry::dir_entries;
+    // the operations need up to two free directory entries
+    const int fills[] = { 0, dir_entries / 2, dir_entries - 2 };
+
+    bool scratch = image.empty();
+    if (scratch && (image = scratch_image()).empty()) {
+        std::cerr << "bench: cannot create a scratch image\n";
+        return 1;
+    }
+    FS fs(false, image.c_str());
+    if (scratch) {
+        // the open descriptor keeps the image alive until fs goes away
+        std::remove(image.c_str());
+    }
+    NullBuffer null;
+    std::streambuf *out = std::cout.rdbuf();
+
+    std::cout << "op,size,fill,iters,ops_per_sec,mb_per_sec,p50_us,p99_us,"
+                 "reads_per_op,writes_per_op\n";
+    for (size_t o = 0; o < ops.size(); o++) {
+        for (uint32_t size : sizes) {
+            for (int fill : fills) {
+                result r;
+                // FS::cat and error messages go to stdout, keep them out of the report
+                std::cout.rdbuf(&null);
+                bool ok = run(fs, ops[o], size, fill, r);
+                std::cout.rdbuf(out);
+                if (!ok) {
+                    // e.g. no room for a second copy of the largest file
+                    std::cerr << "bench: skipped " << ops[o] << " size " << size
+                              << " fill " << fill << "\n";
+                    continue;
+                }
+                double secs = r.seconds > 0 ? r.seconds : 1e-9;
+                std::cout << ops[o] << "," << size << "," << fill << ","
+                          << r.iters << ","
+                          << r.iters / secs << ","
+                          << (double)size * r.iters / secs / (1024 * 1024) << ","
+                          << percentile(r.latencies, 0.50) << ","
+                          << percentile(r.latencies, 0.99) << ","
+                          << (double)r.reads / r.iters << ","
+                          << (double)r.writes / r.iters << "\n";
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,139 @@
+// Compares <copies> concurrent cp_async calls on one thread with the same
+// number of synchronous FS::cp calls in a row, then reads every copy back
+// with read_async and checks it. One CSV row is printed per mode:
+//
+//   mode,copies,seconds,mb_per_sec,max_stall_us
+//
+// max_stall_us is the longest time the calling thread was busy without a
+// chance to serve anything else: one whole cp in sync mode, one batch of
+// resumed coroutines in async mode.
+//
+// Usage: bench_async [copies] [io_threads] [image]
+//
+// The defaults are 16 copies, 4 threads and a scratch image that is
+// removed afterwards.
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <cstdio>
+#include <climits>
+#include <unistd.h>
+#include "fs.h"
+#include "async.h"
+
+#define FILE_SIZE (256 * 1024)
+
+// result of a task that has not finished yet
+#define PENDING INT_MIN
+
+typedef std::chrono::steady_clock clk;
+
+static void
+report(const char *mode, int copies, double secs, double stall_us)
+{
+    std::cout << mode << "," << copies << "," << secs << ","
+              << (double)FILE_SIZE * copies / secs / (1024 * 1024) << ","
+              << stall_us << "\n";
+}
+
+// drives the loop the way an application's own event loop would, through
+// poll() and fd(), and returns the longest poll() in microseconds
+static double
+drive(EventLoop &loop, const std::vector<int> &results)
+{
+    double stall = 0;
+    for (size_t i = 0; i < results.size(); i++) {
+        while (results[i] == PENDING) {
+            clk::time_point t0 = clk::now();
+            int n = loop.poll();
+            std::chrono::duration<double, std::micro> t = clk::now() - t0;
+            if (t.count() > stall) stall = t.count();
+            if (n == 0) {
+                uint64_t count;
+                ssize_t got = ::read(loop.fd(), &count, sizeof(count));
+                (void)got;
+            }
+        }
+    }
+    return stall;
+}
+
+int
+main(int argc, char **argv)
+{
+    int copies = argc > 1 ? std::atoi(argv[1]) : 16;
+    int io_threads = argc > 2 ? std::atoi(argv[2]) : 4;
+
+    std::string image = argc > 3 ? argv[3] : scratch_image();
+    if (image.empty()) {
+        std::cerr << "bench_async: cannot create a scratch image\n";
+        return 1;
+    }
+    FS fs(false, image.c_str());
+    if (argc <= 3) {
+        // the open descriptor keeps the image alive until fs goes away
+        std::remove(image.c_str());
+    }
+    fs.format();
+    // the source and all copies have to fit on the volume
+    int max_copies = FSGeometry::data_blocks / (FILE_SIZE / BLOCK_SIZE) - 1;
+    if (copies > max_copies) {
+        std::cerr << "bench_async: at most " << max_copies << " copies fit\n";
+        copies = max_copies;
+    }
+    std::string data(FILE_SIZE, 'x');
+    for (size_t i = 0; i < data.size(); i += 61) {
+        data[i] = '\n';
+    }
+    if (fs.create("src", data.data(), data.size()) != 0) {
+        std::cerr << "bench_async: cannot create the source file\n";
+        return 1;
+    }
+
+    std::cout << "mode,copies,seconds,mb_per_sec,max_stall_us\n";
+
+    double stall = 0;
+    clk::time_point start = clk::now();
+    for (int i = 0; i < copies; i++) {
+        clk::time_point t0 = clk::now();
+        fs.cp("src", "sync" + std::to_string(i));
+        std::chrono::duration<double, std::micro> one = clk::now() - t0;
+        if (one.count() > stall) stall = one.count();
+    }
+    std::chrono::duration<double> t = clk::now() - start;
+    report("sync", copies, t.count(), stall);
+    for (int i = 0; i < copies; i++) {
+        fs.rm("sync" + std::to_string(i));
+    }
+
+    EventLoop loop;
+    AsyncFS afs(fs, loop, io_threads);
+    std::vector<int> results(copies, PENDING);
+    start = clk::now();
+    for (int i = 0; i < copies; i++) {
+        loop.spawn(afs.cp_async("src", "async" + std::to_string(i)), &results[i]);
+    }
+    stall = drive(loop, results);
+    t = clk::now() - start;
+    report("async", copies, t.count(), stall);
+
+    int errors = 0;
+    std::vector<std::string> back(copies, std::string(FILE_SIZE, '\0'));
+    for (int i = 0; i < copies; i++) {
+        errors += results[i] != 0;
+        results[i] = PENDING;
+        loop.spawn(afs.read_async("async" + std::to_string(i), &back[i][0], FILE_SIZE),
+                   &results[i]);
+    }
+    drive(loop, results);
+    for (int i = 0; i < copies; i++) {
+        errors += results[i] != FILE_SIZE || back[i] != data;
+    }
+    if (errors) {
+        std::cerr << "bench_async: " << errors << " copies failed\n";
+        return 1;
+    }
+    return 0;
+}
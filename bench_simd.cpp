@@ -0,0 +1,159 @@
+// Microbenchmarks for the FAT scan and directory lookup kernels on a full
+// volume and a full directory. Every kernel is timed at every SIMD level the
+// CPU supports, plus the old std::string lookup loop and the hashed lookup
+// in the directory mirror, and the block checksum with every CRC-32C
+// implementation. One CSV row is printed per combination:
+//
+//   kernel,level,ns_per_call,speedup
+//
+// speedup is relative to the scalar level of the same kernel.
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include "fs.h"
+#include "simd.h"
+#include "crc32c.h"
+
+#define CALLS 200000
+
+static volatile long sink;
+
+typedef std::chrono::steady_clock clk;
+
+template <typename Op>
+static double
+ns_per_call(Op op)
+{
+    long acc = 0;
+    clk::time_point start = clk::now();
+    for (int i = 0; i < CALLS; i++) {
+        acc += op();
+    }
+    std::chrono::duration<double> t = clk::now() - start;
+    sink = acc;
+    return t.count() * 1e9 / CALLS;
+}
+
+static void
+report(const char *kernel, const char *level, double ns, double scalar_ns)
+{
+    std::cout << kernel << "," << level << "," << ns << "," << scalar_ns / ns << "\n";
+}
+
+// fills <entries> with 64 names sharing a prefix of <prefix> bytes
+static void
+fill_dir(dir_entry *entries, const std::string &prefix)
+{
+    std::memset(entries, 0, BLOCK_SIZE);
+    for (unsigned i = 0; i < FSGeometry::dir_entries; i++) {
+        std::snprintf(entries[i].file_name, sizeof(entries[i].file_name), "%s%02u",
+                      prefix.c_str(), i);
+    }
+}
+
+// the lookup loop FS::find_entry used before the kernels and the mirror
+static int
+find_string(const dir_entry *entries, const std::string &name)
+{
+    for (unsigned i = 0; i < FSGeometry::dir_entries; i++) {
+        if (entries[i].file_name[0] != '\0' && name == entries[i].file_name) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int
+main()
+{
+    const unsigned n = FSGeometry::blocks;
+    const unsigned first = FSGeometry::first_data_block;
+
+    // every block in use but the last one
+    std::vector<int16_t> full(n, FAT_EOF);
+    full[n - 1] = FAT_FREE;
+    // free runs of 15 blocks between used ones, so no run of 16 exists
+    std::vector<int16_t> fragmented(n, FAT_FREE);
+    for (unsigned i = first; i < n; i += 16) {
+        fragmented[i] = FAT_EOF;
+    }
+
+    dir_entry short_names[FSGeometry::dir_entries];
+    dir_entry long_names[FSGeometry::dir_entries];
+    fill_dir(short_names, "file");
+    fill_dir(long_names, "a_rather_long_common_name_prefix_");
+    const std::string short_last = "file63";
+    const std::string long_last = "a_rather_long_common_name_prefix_63";
+    const unsigned max = sizeof(short_names[0].file_name);
+
+    int best = simd_select();
+    std::cout << "kernel,level,ns_per_call,speedup\n";
+
+    double scalar_ns[6] = { 0 };
+    for (int level = SIMD_SCALAR; level <= best; level++) {
+        simd_select(level);
+        const char *lv = simd_level_names[level];
+        double ns[6];
+        ns[0] = ns_per_call([&] { return (long)fat_find_free(full.data(), first, n); });
+        ns[1] = ns_per_call([&] { return (long)fat_count_free(full.data(), first, n); });
+        ns[2] = ns_per_call([&] {
+            return (long)fat_find_free_run(fragmented.data(), first, n, 16); });
+        ns[3] = ns_per_call([&] {
+            return (long)name_match(short_names[0].file_name, sizeof(dir_entry), max,
+                                    FSGeometry::dir_entries, short_last.c_str()); });
+        ns[4] = ns_per_call([&] {
+            return (long)name_match(long_names[0].file_name, sizeof(dir_entry), max,
+                                    FSGeometry::dir_entries, long_last.c_str()); });
+        ns[5] = ns_per_call([&] {
+            return (long)name_match(short_names[0].file_name, sizeof(dir_entry), max,
+                                    FSGeometry::dir_entries, "missing"); });
+        if (level == SIMD_SCALAR) {
+            for (int k = 0; k < 6; k++) {
+                scalar_ns[k] = ns[k];
+            }
+        }
+        report("fat_find_free_full", lv, ns[0], scalar_ns[0]);
+        report("fat_count_free", lv, ns[1], scalar_ns[1]);
+        report("fat_find_free_run16_fragmented", lv, ns[2], scalar_ns[2]);
+        report("name_match_short_last", lv, ns[3], scalar_ns[3]);
+        report("name_match_long_prefix_last", lv, ns[4], scalar_ns[4]);
+        report("name_match_missing", lv, ns[5], scalar_ns[5]);
+    }
+    simd_select();
+
+    double str_short = ns_per_call([&] { return (long)find_string(short_names, short_last); });
+    double str_long = ns_per_call([&] { return (long)find_string(long_names, long_last); });
+    report("name_match_short_last", "std::string", str_short, scalar_ns[3]);
+    report("name_match_long_prefix_last", "std::string", str_long, scalar_ns[4]);
+
+    DirMirror<FSGeometry> short_dir, long_dir;
+    short_dir.load(short_names);
+    long_dir.load(long_names);
+    double mirror_short = ns_per_call([&] {
+        return (long)short_dir.find(short_names, short_last.data(), short_last.size()); });
+    double mirror_long = ns_per_call([&] {
+        return (long)long_dir.find(long_names, long_last.data(), long_last.size()); });
+    report("name_match_short_last", "mirror", mirror_short, scalar_ns[3]);
+    report("name_match_long_prefix_last", "mirror", mirror_long, scalar_ns[4]);
+
+    // what verifying one block costs a read
+    std::vector<uint8_t> block(BLOCK_SIZE);
+    for (unsigned i = 0; i < BLOCK_SIZE; i++) {
+        block[i] = i * 131 + 7;
+    }
+    int best_crc = crc32c_select();
+    double table_ns = 0;
+    for (int impl = CRC32C_SLICING8; impl <= best_crc; impl++) {
+        crc32c_select(impl);
+        double ns = ns_per_call([&] { return (long)crc32c(block.data(), BLOCK_SIZE); });
+        if (impl == CRC32C_SLICING8) {
+            table_ns = ns;
+        }
+        report("crc32c_block", crc32c_impl_names[impl], ns, table_ns);
+    }
+    crc32c_select();
+    return 0;
+}
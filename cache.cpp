@@ -0,0 +1,567 @@
+#include <cstring>
+#include <algorithm>
+#include "cache.h"
+
+BlockCache::BlockCache(Disk &disk, IOStats *stats, unsigned nslots)
+    : disk(disk), stats(stats), slots(nslots), where(disk.get_no_blocks(), -1),
+      stop(false), writeback_on(false), flush_stop(false), ndirty(0)
+{
+    head[0] = head[1] = tail[0] = tail[1] = -1;
+    count[0] = count[1] = 0;
+    for (unsigned i = 0; i < nslots; i++) {
+        slots[i].blk = -1;
+        slots[i].low = false;
+        slots[i].reading = false;
+        slots[i].stale = false;
+        slots[i].dirty = false;
+        slots[i].writing = false;
+        free_slots.push_back(nslots - 1 - i);
+    }
+    reader = std::thread(&BlockCache::read_loop, this);
+}
+
+BlockCache::~BlockCache()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stop = true;
+    }
+    queued.notify_all();
+    reader.join();
+}
+
+void
+BlockCache::unlink(int i)
+{
+    slot &s = slots[i];
+    if (s.prev != -1) slots[s.prev].next = s.next; else head[s.low] = s.next;
+    if (s.next != -1) slots[s.next].prev = s.prev; else tail[s.low] = s.prev;
+    count[s.low]--;
+}
+
+void
+BlockCache::push_front(int i)
+{
+    int l = slots[i].low;
+    slots[i].prev = -1;
+    slots[i].next = head[l];
+    if (head[l] != -1) slots[head[l]].prev = i; else tail[l] = i;
+    head[l] = i;
+    count[l]++;
+}
+
+int
+BlockCache::claim(int blk, bool low)
+{
+    int i;
+    if (!free_slots.empty()) {
+        i = free_slots.back();
+        free_slots.pop_back();
+    } else {
+        // the oldest low priority block goes once scans hold their share,
+        // else the least recently used one
+        bool scan = count[0] == 0 || (count[1] != 0 && count[1] >= slots.size() / 4);
+        i = victim(scan ? 1 : 0);
+        if (i == -1) {
+            i = victim(scan ? 0 : 1);
+        }
+        if (i == -1) {
+            return -1;
+        }
+        unlink(i);
+        where[slots[i].blk] = -1;
+    }
+    slots[i].blk = blk;
+    slots[i].low = low;
+    slots[i].reading = true;
+    slots[i].stale = false;
+    slots[i].dirty = false;
+    slots[i].writing = false;
+    where[blk] = i;
+    return i;
+}
+
+int
+BlockCache::victim(int l)
+{
+    for (int i = tail[l]; i != -1; i = slots[i].prev) {
+        if (!slots[i].dirty && !slots[i].writing) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void
+BlockCache::release(int i)
+{
+    slot &s = slots[i];
+    if (where[s.blk] == i) {
+        where[s.blk] = -1;
+    }
+    if (s.dirty) {
+        ndirty--;
+        cleaned.notify_all();
+    }
+    s.blk = -1;
+    s.reading = false;
+    s.stale = false;
+    s.dirty = false;
+    s.writing = false;
+    free_slots.push_back(i);
+}
+
+void
+BlockCache::mark_dirty(int i)
+{
+    if (slots[i].dirty) {
+        return;
+    }
+    slots[i].dirty = true;
+    slots[i].dirtied = std::chrono::steady_clock::now();
+    // the flusher learns of a new deadline or of too many dirty blocks
+    if (ndirty++ == 0 || ndirty * 100 >= slots.size() * WB_BACKGROUND_RATIO) {
+        dirtied.notify_one();
+    }
+}
+
+bool
+BlockCache::put_dirty(unsigned blk, const uint8_t *buf)
+{
+    int i = where[blk];
+    if (i == -1) {
+        i = claim(blk, false);
+        if (i == -1) {
+            return false;
+        }
+        slots[i].reading = false;
+    } else {
+        unlink(i);
+        slots[i].low = false;
+    }
+    std::memcpy(slots[i].data, buf, BLOCK_SIZE);
+    mark_dirty(i);
+    push_front(i);
+    return true;
+}
+
+void
+BlockCache::throttle(std::unique_lock<std::mutex> &guard)
+{
+    while (ndirty * 100 >= slots.size() * WB_DIRTY_RATIO) {
+        if (stats) stats->throttled();
+        dirtied.notify_one();
+        cleaned.wait(guard);
+    }
+}
+
+void
+BlockCache::complete(int i, bool ok)
+{
+    if (ok && !slots[i].stale) {
+        slots[i].reading = false;
+        push_front(i);
+    } else {
+        release(i);
+    }
+    filled.notify_all();
+}
+
+int
+BlockCache::read(unsigned blk, uint8_t *buf, bool low)
+{
+    if (blk >= where.size()) {
+        return disk.read(blk, buf);
+    }
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        int i = where[blk];
+        if (i == -1) {
+            break;
+        }
+        if (slots[i].reading) {
+            // read ahead and on its way
+            filled.wait(guard);
+            continue;
+        }
+        std::memcpy(buf, slots[i].data, BLOCK_SIZE);
+        // a low priority read leaves the block where it is
+        if (!low) {
+            unlink(i);
+            slots[i].low = false;
+            push_front(i);
+        }
+        if (stats) stats->block_hit();
+        return 0;
+    }
+    if (stats) stats->block_miss();
+    int i = claim(blk, low);
+    guard.unlock();
+    // the slot is ours until complete() is called
+    int ret = disk.read(blk, i == -1 ? buf : slots[i].data);
+    if (i == -1) {
+        return ret;
+    }
+    if (ret == 0) {
+        std::memcpy(buf, slots[i].data, BLOCK_SIZE);
+    }
+    guard.lock();
+    complete(i, ret == 0);
+    return ret;
+}
+
+int
+BlockCache::write(unsigned blk, uint8_t *buf)
+{
+    if (blk >= where.size()) {
+        return disk.write(blk, buf);
+    }
+    std::unique_lock<std::mutex> guard(lock);
+    // a read of the old contents in flight lands first
+    while (where[blk] != -1 && slots[where[blk]].reading) {
+        filled.wait(guard);
+    }
+    if (writeback_on && put_dirty(blk, buf)) {
+        throttle(guard);
+        return 0;
+    }
+    guard.unlock();
+    int ret = disk.write(blk, buf);
+    guard.lock();
+    while (where[blk] != -1 && slots[where[blk]].reading) {
+        filled.wait(guard);
+    }
+    int i = where[blk];
+    if (ret != 0) {
+        if (i != -1) {
+            unlink(i);
+            release(i);
+        }
+        return ret;
+    }
+    if (i == -1) {
+        i = claim(blk, false);
+        if (i == -1) {
+            return 0;
+        }
+        slots[i].reading = false;
+    } else {
+        unlink(i);
+        slots[i].low = false;
+    }
+    std::memcpy(slots[i].data, buf, BLOCK_SIZE);
+    // an older copy may still be on its way to the disk, this one follows
+    if (slots[i].dirty || slots[i].writing) {
+        mark_dirty(i);
+    }
+    push_front(i);
+    return 0;
+}
+
+int
+BlockCache::write_run(unsigned blk, unsigned n, const uint8_t *buf)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    if (writeback_on && blk + n <= where.size()) {
+        for (unsigned k = 0; k < n; k++) {
+            while (where[blk + k] != -1 && slots[where[blk + k]].reading) {
+                filled.wait(guard);
+            }
+            uint8_t *b = const_cast<uint8_t*>(buf + (size_t)k * BLOCK_SIZE);
+            if (!put_dirty(blk + k, b)) {
+                // no clean slot left, this block goes to the disk now
+                guard.unlock();
+                int ret = disk.write(blk + k, b);
+                guard.lock();
+                if (ret != 0) {
+                    return ret;
+                }
+            }
+        }
+        throttle(guard);
+        return 0;
+    }
+    guard.unlock();
+    int ret = disk.write_run(blk, n, buf);
+    if (ret != 0) {
+        for (unsigned k = 0; k < n; k++) {
+            invalidate(blk + k);
+        }
+        return ret;
+    }
+    guard.lock();
+    for (unsigned k = 0; k < n && blk + k < where.size(); k++) {
+        while (where[blk + k] != -1 && slots[where[blk + k]].reading) {
+            filled.wait(guard);
+        }
+        int i = where[blk + k];
+        if (i == -1) {
+            i = claim(blk + k, false);
+            if (i == -1) {
+                continue;
+            }
+            slots[i].reading = false;
+        } else {
+            unlink(i);
+            slots[i].low = false;
+        }
+        std::memcpy(slots[i].data, buf + (size_t)k * BLOCK_SIZE, BLOCK_SIZE);
+        if (slots[i].dirty || slots[i].writing) {
+            mark_dirty(i);
+        }
+        push_front(i);
+    }
+    return 0;
+}
+
+void
+BlockCache::prefetch(const std::vector<int> &blocks, bool low)
+{
+    std::vector<int> claimed;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (size_t k = 0; k < blocks.size(); k++) {
+            int b = blocks[k];
+            if (b < 0 || b >= (int)where.size() || where[b] != -1) {
+                continue;
+            }
+            int i = claim(b, low);
+            if (i == -1) {
+                break;
+            }
+            claimed.push_back(i);
+        }
+        if (claimed.empty()) {
+            return;
+        }
+        queue.push_back(claimed);
+    }
+    queued.notify_one();
+}
+
+void
+BlockCache::invalidate(unsigned blk, bool freed)
+{
+    if (blk >= where.size()) {
+        return;
+    }
+    std::unique_lock<std::mutex> guard(lock);
+    // a write-back in flight lands before the caller changes the block
+    while (where[blk] != -1 && slots[where[blk]].writing) {
+        cleaned.wait(guard);
+    }
+    int i = where[blk];
+    if (i == -1) {
+        return;
+    }
+    if (slots[i].reading) {
+        // the reader drops it, later lookups must not wait for it
+        slots[i].stale = true;
+        where[blk] = -1;
+        return;
+    }
+    if (slots[i].dirty && !freed) {
+        // newer than the disk, only the write-back may drop it
+        return;
+    }
+    unlink(i);
+    release(i);
+}
+
+void
+BlockCache::clear()
+{
+    for (unsigned b = 0; b < where.size(); b++) {
+        invalidate(b, true);
+    }
+}
+
+// background thread: reads the claimed blocks of each prefetch
+void
+BlockCache::read_loop()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        while (!stop && queue.empty()) {
+            queued.wait(guard);
+        }
+        if (queue.empty()) {
+            return;
+        }
+        std::vector<int> claimed;
+        claimed.swap(queue.front());
+        queue.pop_front();
+        guard.unlock();
+        fill(claimed);
+        guard.lock();
+    }
+}
+
+// reads the slots in <claimed>, one disk call per run of consecutive blocks
+void
+BlockCache::fill(const std::vector<int> &claimed)
+{
+    std::vector<uint8_t> run;
+    size_t k = 0;
+    while (k < claimed.size()) {
+        size_t n = 1;
+        while (k + n < claimed.size() &&
+               slots[claimed[k + n]].blk == slots[claimed[k]].blk + (int)n) {
+            n++;
+        }
+        run.resize(n * BLOCK_SIZE);
+        int ret = disk.read_run(slots[claimed[k]].blk, n, run.data());
+        if (ret == 0) {
+            for (size_t j = 0; j < n; j++) {
+                std::memcpy(slots[claimed[k + j]].data, run.data() + j * BLOCK_SIZE, BLOCK_SIZE);
+            }
+            if (stats) stats->readahead(n);
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            for (size_t j = 0; j < n; j++) {
+                complete(claimed[k + j], ret == 0);
+            }
+        }
+        k += n;
+    }
+}
+
+void
+BlockCache::set_writeback(bool on)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        writeback_on = on;
+    }
+    if (!on) {
+        writeback(true);
+    }
+}
+
+bool
+BlockCache::wait_writeback()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while (!flush_stop) {
+        if (ndirty * 100 >= slots.size() * WB_BACKGROUND_RATIO) {
+            return true;
+        }
+        if (ndirty == 0) {
+            dirtied.wait(guard);
+            continue;
+        }
+        std::chrono::steady_clock::time_point oldest = std::chrono::steady_clock::time_point::max();
+        for (size_t i = 0; i < slots.size(); i++) {
+            if (slots[i].dirty && slots[i].dirtied < oldest) {
+                oldest = slots[i].dirtied;
+            }
+        }
+        std::chrono::steady_clock::time_point due = oldest + std::chrono::milliseconds(WB_AGE_MS);
+        if (std::chrono::steady_clock::now() >= due) {
+            return true;
+        }
+        dirtied.wait_until(guard, due);
+    }
+    return false;
+}
+
+void
+BlockCache::stop_writeback()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        flush_stop = true;
+    }
+    dirtied.notify_all();
+}
+
+// The blocks are copied and marked clean under the lock and written
+// outside it. A block written again meanwhile is dirty again and goes out
+// in a later pass; flush_lock keeps that pass behind this one.
+unsigned
+BlockCache::writeback(bool all)
+{
+    std::lock_guard<std::mutex> fguard(flush_lock);
+    std::unique_lock<std::mutex> guard(lock);
+    std::vector<std::pair<int, int> > picked; // block and slot
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    // over the background ratio everything goes, in one sorted pass
+    bool over = ndirty * 100 >= slots.size() * WB_BACKGROUND_RATIO;
+    for (size_t i = 0; i < slots.size(); i++) {
+        const slot &s = slots[i];
+        if (s.dirty && (all || over ||
+                        now - s.dirtied >= std::chrono::milliseconds(WB_AGE_MS))) {
+            picked.push_back(std::make_pair(s.blk, (int)i));
+        }
+    }
+    return write_picked(guard, picked);
+}
+
+unsigned
+BlockCache::writeback_blocks(const std::vector<int> &blocks)
+{
+    std::lock_guard<std::mutex> fguard(flush_lock);
+    std::unique_lock<std::mutex> guard(lock);
+    std::vector<std::pair<int, int> > picked; // block and slot
+    for (size_t k = 0; k < blocks.size(); k++) {
+        int b = blocks[k];
+        if (b < 0 || b >= (int)where.size() || where[b] == -1) {
+            continue;
+        }
+        const slot &s = slots[where[b]];
+        if (s.dirty && !s.reading) {
+            picked.push_back(std::make_pair(b, where[b]));
+        }
+    }
+    return write_picked(guard, picked);
+}
+
+unsigned
+BlockCache::write_picked(std::unique_lock<std::mutex> &guard,
+                         std::vector<std::pair<int, int> > &picked)
+{
+    std::vector<uint8_t> data;
+    std::sort(picked.begin(), picked.end());
+    data.resize(picked.size() * BLOCK_SIZE);
+    for (size_t k = 0; k < picked.size(); k++) {
+        slot &s = slots[picked[k].second];
+        std::memcpy(&data[k * BLOCK_SIZE], s.data, BLOCK_SIZE);
+        s.dirty = false;
+        s.writing = true;
+    }
+    ndirty -= picked.size();
+    guard.unlock();
+
+    unsigned written = 0;
+    size_t k = 0;
+    while (k < picked.size()) {
+        size_t n = 1;
+        while (k + n < picked.size() && picked[k + n].first == picked[k].first + (int)n) {
+            n++;
+        }
+        int ret = disk.write_run(picked[k].first, n, &data[k * BLOCK_SIZE]);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            for (size_t j = k; j < k + n; j++) {
+                slot &s = slots[picked[j].second];
+                if (s.blk != picked[j].first) {
+                    // dropped meanwhile
+                    continue;
+                }
+                s.writing = false;
+                if (ret != 0) {
+                    // kept for the next pass
+                    mark_dirty(picked[j].second);
+                }
+            }
+            cleaned.notify_all();
+        }
+        if (ret == 0) {
+            written += n;
+        }
+        k += n;
+    }
+    if (stats && written) stats->written_back(written);
+    return written;
+}
@@ -0,0 +1,129 @@
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include "disk.h"
+#include "stats.h"
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+// number of data blocks kept in memory
+#define CACHE_BLOCKS 256
+
+// Write-back: a dirty block is written once it is WB_AGE_MS old, or as soon
+// as WB_BACKGROUND_RATIO percent of the cache is dirty. Writers wait while
+// WB_DIRTY_RATIO percent is.
+#define WB_AGE_MS 500
+#define WB_BACKGROUND_RATIO 25
+#define WB_DIRTY_RATIO 50
+
+// An LRU cache of data blocks in front of the disk. Writes go through to
+// the disk and leave the block cached. Blocks read at low priority, by
+// scans that will not come back to them, are kept on a second list that
+// is evicted first and in the order the blocks came in, so a scan does not
+// push the blocks of other readers out. The scan keeps at least a quarter
+// of the cache, enough for its readahead. Blocks can be read ahead: prefetch
+// claims the blocks that are not cached and a background thread reads them,
+// merged into one call per run of consecutive blocks. A read of a block
+// that is on its way waits for it instead of reading it again.
+//
+// With write-back on, writes only fill the cache. The dirty blocks are
+// written by writeback(), sorted by block number and merged into runs,
+// from a flusher thread that waits for them in wait_writeback(). A dirty
+// block, or one being written back, is never evicted.
+class BlockCache {
+private:
+    struct slot {
+        int blk; // -1 when the slot is free
+        int prev, next; // LRU list, most recently used first
+        bool low; // on the low priority list
+        bool reading; // being filled outside the lock, not on the list
+        bool stale; // invalidated while being read, dropped when it arrives
+        bool dirty; // newer than the disk
+        bool writing; // being written back outside the lock
+        std::chrono::steady_clock::time_point dirtied; // when it became dirty
+        uint8_t data[BLOCK_SIZE];
+    };
+
+    Disk &disk;
+    IOStats *stats;
+    std::vector<slot> slots;
+    std::vector<int> where; // slot of every block, or -1
+    std::vector<int> free_slots;
+    // ends and lengths of the normal and the low priority list
+    int head[2], tail[2];
+    unsigned count[2];
+    std::mutex lock;
+    std::condition_variable filled;
+    // claimed blocks waiting for the readahead thread
+    std::deque<std::vector<int> > queue;
+    std::condition_variable queued;
+    bool stop;
+    std::thread reader;
+    // write-back state
+    bool writeback_on;
+    bool flush_stop;
+    unsigned ndirty;
+    std::condition_variable dirtied; // wakes the flusher
+    std::condition_variable cleaned; // wakes throttled writers
+    // one write-back at a time, so two copies of a block cannot reach the
+    // disk out of order
+    std::mutex flush_lock;
+
+    void unlink(int i);
+    void push_front(int i);
+    // a slot for <blk>, marked reading, or -1 if every slot is being read
+    int claim(int blk, bool low);
+    // ends the read into slot <i>, keeping it if <ok>
+    void complete(int i, bool ok);
+    void release(int i);
+    // stores <buf> in the cache as the dirty contents of <blk>, false if
+    // there is no slot for it
+    bool put_dirty(unsigned blk, const uint8_t *buf);
+    // a clean slot on list <l> to evict, or -1
+    int victim(int l);
+    void mark_dirty(int i);
+    // waits while too much of the cache is dirty
+    void throttle(std::unique_lock<std::mutex> &guard);
+    // writes the dirty slots in <picked> (block and slot) outside <guard>,
+    // which is held on entry; flush_lock is held throughout
+    unsigned write_picked(std::unique_lock<std::mutex> &guard,
+                          std::vector<std::pair<int, int> > &picked);
+    void read_loop();
+    void fill(const std::vector<int> &blocks);
+
+public:
+    BlockCache(Disk &disk, IOStats *stats, unsigned nslots = CACHE_BLOCKS);
+    ~BlockCache();
+    // Disk::read and Disk::write through the cache
+    int read(unsigned blk, uint8_t *buf, bool low = false);
+    int write(unsigned blk, uint8_t *buf);
+    int write_run(unsigned blk, unsigned n, const uint8_t *buf);
+    // reads the blocks of <blocks> that are not cached in the background
+    void prefetch(const std::vector<int> &blocks, bool low = false);
+    // forgets <blk>, whose contents on the disk are about to change, once
+    // a write-back of it in flight has landed. A dirty block is kept
+    // unless <blk> was <freed> and its contents no longer matter.
+    void invalidate(unsigned blk, bool freed = false);
+    // forgets every block, dirty ones too
+    void clear();
+    unsigned capacity() { return slots.size(); }
+
+    // turning write-back off writes every dirty block first
+    void set_writeback(bool on);
+    // waits until some dirty blocks are due, returns false once
+    // stop_writeback() was called
+    bool wait_writeback();
+    void stop_writeback();
+    // writes the dirty blocks that are due, or all of them, and returns how
+    // many were written
+    unsigned writeback(bool all);
+    // writes the dirty blocks among <blocks>, negative entries are skipped
+    unsigned writeback_blocks(const std::vector<int> &blocks);
+};
+
+#endif // __CACHE_H__
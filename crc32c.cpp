@@ -0,0 +1,130 @@
+#include <cstring>
+#include <atomic>
+#include "crc32c.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CRC32C_X86 1
+#include <immintrin.h>
+#endif
+
+// reflected Castagnoli polynomial
+#define CRC32C_POLY 0x82f63b78u
+
+const char *crc32c_impl_names[CRC32C_IMPLS] = { "slicing8", "sse4.2" };
+
+// table[k][b] is the CRC of byte b followed by k zero bytes
+static uint32_t table[8][256];
+
+static bool
+init_table()
+{
+    for (unsigned b = 0; b < 256; b++) {
+        uint32_t c = b;
+        for (int k = 0; k < 8; k++) {
+            c = (c >> 1) ^ (c & 1 ? CRC32C_POLY : 0);
+        }
+        table[0][b] = c;
+    }
+    for (unsigned b = 0; b < 256; b++) {
+        for (int k = 1; k < 8; k++) {
+            table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xff];
+        }
+    }
+    return true;
+}
+
+static const bool table_ready = init_table();
+
+static uint32_t
+crc_slicing8(const uint8_t *p, size_t n, uint32_t c)
+{
+    for (; n > 0 && ((uintptr_t)p & 7); n--) {
+        c = (c >> 8) ^ table[0][(c ^ *p++) & 0xff];
+    }
+    // eight bytes per step, the tables fold them in independently
+    for (; n >= 8; n -= 8, p += 8) {
+        uint32_t lo, hi;
+        std::memcpy(&lo, p, 4);
+        std::memcpy(&hi, p + 4, 4);
+        lo ^= c;
+        c = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^
+            table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+            table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^
+            table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+    }
+    for (; n > 0; n--) {
+        c = (c >> 8) ^ table[0][(c ^ *p++) & 0xff];
+    }
+    return c;
+}
+
+#ifdef CRC32C_X86
+
+__attribute__((target("sse4.2")))
+static uint32_t
+crc_sse42(const uint8_t *p, size_t n, uint32_t c)
+{
+    for (; n > 0 && ((uintptr_t)p & 7); n--) {
+        c = _mm_crc32_u8(c, *p++);
+    }
+#ifdef __x86_64__
+    uint64_t c64 = c;
+    for (; n >= 8; n -= 8, p += 8) {
+        uint64_t v;
+        std::memcpy(&v, p, 8);
+        c64 = _mm_crc32_u64(c64, v);
+    }
+    c = (uint32_t)c64;
+#endif
+    for (; n >= 4; n -= 4, p += 4) {
+        uint32_t v;
+        std::memcpy(&v, p, 4);
+        c = _mm_crc32_u32(c, v);
+    }
+    for (; n > 0; n--) {
+        c = _mm_crc32_u8(c, *p++);
+    }
+    return c;
+}
+
+#endif
+
+// starts out table driven, so calls made before the selection are safe
+static std::atomic<int> active(CRC32C_SLICING8);
+
+int
+crc32c_select(int impl)
+{
+    int best = CRC32C_SLICING8;
+#ifdef CRC32C_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        best = CRC32C_SSE42;
+    }
+#endif
+    if (impl < CRC32C_SLICING8) {
+        impl = CRC32C_SLICING8;
+    }
+    active.store(impl < best ? impl : best, std::memory_order_relaxed);
+    return crc32c_active();
+}
+
+int
+crc32c_active()
+{
+    return active.load(std::memory_order_relaxed);
+}
+
+static const int selected = crc32c_select();
+
+uint32_t
+crc32c(const void *p, size_t n, uint32_t crc)
+{
+    const uint8_t *b = static_cast<const uint8_t*>(p);
+#ifdef CRC32C_X86
+    if (active.load(std::memory_order_relaxed) == CRC32C_SSE42) {
+        return ~crc_sse42(b, n, ~crc);
+    }
+#endif
+    return ~crc_slicing8(b, n, ~crc);
+}
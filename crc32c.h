@@ -0,0 +1,28 @@
+#include <cstddef>
+#include <cstdint>
+
+#ifndef __CRC32C_H__
+#define __CRC32C_H__
+
+// CRC-32C (Castagnoli), the checksum kept for every block of the volume.
+// The SSE4.2 crc32 instruction is used when the CPU has it, a table driven
+// slicing-by-8 loop otherwise.
+
+enum crc32c_impl {
+    CRC32C_SLICING8,
+    CRC32C_SSE42,
+    CRC32C_IMPLS
+};
+
+extern const char *crc32c_impl_names[CRC32C_IMPLS];
+
+// switches to the fastest implementation the CPU supports, but no faster
+// than <impl>, and returns the one now in use
+int crc32c_select(int impl = CRC32C_SSE42);
+int crc32c_active();
+
+// CRC of the <n> bytes at <p>. <crc> is the result for the bytes before
+// them, so a buffer may be checksummed in pieces.
+uint32_t crc32c(const void *p, size_t n, uint32_t crc = 0);
+
+#endif // __CRC32C_H__
@@ -0,0 +1,115 @@
+#include <cstdint>
+#include <cstring>
+
+#ifndef __DIRMIRROR_H__
+#define __DIRMIRROR_H__
+
+// 32-bit FNV-1a hash of a file name
+inline uint32_t
+name_hash(const char *name, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return h;
+}
+
+// Structure-of-arrays copy of a directory block of geometry <G>. Lookups
+// compare name hashes and only read the 64-byte entry whose hash matches,
+// listing and free slot searches walk the occupancy bitmap. The owner
+// calls update() for every entry it changes in the block.
+template <class G>
+class DirMirror {
+public:
+    typedef typename G::dir_entry entry;
+    static const unsigned slots = G::dir_entries;
+    static_assert(slots <= 64, "the occupancy bitmap is one 64-bit word");
+
+    uint64_t used; // bit i is set when entry i holds a name
+    uint32_t hash[slots];
+    uint32_t size[slots];
+    uint16_t first_blk[slots];
+    uint8_t type[slots];
+
+    // rebuilds the mirror from the directory block
+    void load(const entry *entries)
+    {
+        used = 0;
+        for (unsigned i = 0; i < slots; i++) {
+            update(entries, i);
+        }
+    }
+
+    // refreshes slot <i> from entries[i]
+    void update(const entry *entries, unsigned i)
+    {
+        const entry &e = entries[i];
+        if (e.file_name[0] == '\0') {
+            used &= ~((uint64_t)1 << i);
+            hash[i] = size[i] = first_blk[i] = type[i] = 0;
+            return;
+        }
+        used |= (uint64_t)1 << i;
+        hash[i] = name_hash(e.file_name, strnlen(e.file_name, sizeof(e.file_name)));
+        size[i] = e.size;
+        first_blk[i] = e.first_blk;
+        type[i] = e.type;
+    }
+
+    // index of the entry called <name> (<len> bytes), or -1
+    int find(const entry *entries, const char *name, size_t len) const
+    {
+        // stored names are NUL-terminated, so longer names can never match
+        if (len == 0 || len >= sizeof(entries[0].file_name)) {
+            return -1;
+        }
+        uint32_t h = name_hash(name, len);
+        // branch-free so the compiler can vectorize the hash compare
+        uint64_t match = 0;
+        for (unsigned i = 0; i < slots; i++) {
+            match |= (uint64_t)(hash[i] == h) << i;
+        }
+        match &= used;
+        while (match) {
+            int i = __builtin_ctzll(match);
+            if (std::memcmp(entries[i].file_name, name, len) == 0 &&
+                entries[i].file_name[len] == '\0') {
+                return i;
+            }
+            match &= match - 1;
+        }
+        return -1;
+    }
+
+    // number of entries whose chain starts at <blk>
+    unsigned refs(uint16_t blk) const
+    {
+        unsigned n = 0;
+        for (unsigned i = 0; i < slots; i++) {
+            n += (first_blk[i] == blk) & (unsigned)(used >> i) & 1;
+        }
+        return n;
+    }
+
+    // index of the first entry whose chain starts at <blk>, or -1
+    int find_chain(uint16_t blk) const
+    {
+        for (uint64_t u = used; u; u &= u - 1) {
+            int i = __builtin_ctzll(u);
+            if (first_blk[i] == blk) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    // index of the first unused entry, or -1
+    int free_slot() const
+    {
+        uint64_t free = ~used & (~(uint64_t)0 >> (64 - slots));
+        return free ? __builtin_ctzll(free) : -1;
+    }
+};
+
+#endif // __DIRMIRROR_H__
@@ -1,27 +1,35 @@
 #include <iostream>
+#include <thread>
+#include <chrono>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
 #include "disk.h"
+#include "span.h"
+#include "crc32c.h"
 
-Disk::Disk()
+Disk::Disk(const char *image) : sums(nullptr), skip_from(0), skip_to(0), verified(0), mismatches(0),
+    latency_us(0)
 {
     // first check if the disk file exists, otherwise create it.
-    if (!disk_file_exists(DISKNAME)) {
+    if (!disk_file_exists(image)) {
         std::cout << "No disk file found...\n";
-        std::cout << "Creating disk file: " << DISKNAME << std::endl;
-        std::ofstream f(DISKNAME, std::ios::binary | std::ios::out);
-        f.seekp((1<<23)-1);
+        std::cout << "Creating disk file: " << image << std::endl;
+        std::ofstream f(image, std::ios::binary | std::ios::out);
+        f.seekp((off_t)BLOCK_SIZE * DISK_BLOCKS - 1);
         f.write("", 1);
     }
     // the disk is simulated as a binary file
-    diskfile.open(DISKNAME, std::ios::in | std::ios::out | std::ios::binary);
-    if (!diskfile.is_open()) {
-        std::cerr << "ERROR: Can't open diskfile: " << DISKNAME << ", exiting..."<< std::endl;
+    fd = open(image, O_RDWR);
+    if (fd < 0) {
+        std::cerr << "ERROR: Can't open diskfile: " << image << ", exiting..."<< std::endl;
         exit(-1);
     }
 }
 
 Disk::~Disk()
 {
-    diskfile.close();
+    close(fd);
 }
 
 bool
@@ -34,6 +42,7 @@ Disk::disk_file_exists (const std::string& name) {
 int
 Disk::write(unsigned block_no, uint8_t *blk)
 {
+    Span span("write blk", block_no);
     if (DEBUG)
         std::cout << "Disk::write(" << block_no << ")\n";
     // check if valid block number
@@ -41,10 +50,11 @@ Disk::write(unsigned block_no, uint8_t *blk)
         std::cout << "Disk::write - ERROR: Invalid block number (" << block_no << ")\n";
         return -1;
     }
-    unsigned offset = block_no * BLOCK_SIZE;
-    diskfile.seekp(offset, std::ios_base::beg);
-    diskfile.write((char*)blk, BLOCK_SIZE);
-    diskfile.flush();
+    off_t offset = (off_t)block_no * BLOCK_SIZE;
+    delay();
+    if (pwrite(fd, blk, BLOCK_SIZE, offset) != BLOCK_SIZE)
+        return -1;
+    update(block_no, blk);
     return 0;
 }
 
@@ -52,6 +62,7 @@ Disk::write(unsigned block_no, uint8_t *blk)
 int
 Disk::read(unsigned block_no, uint8_t *blk)
 {
+    Span span("read blk", block_no);
     if (DEBUG)
         std::cout << "Disk::read(" << block_no << ")\n";
     // check if valid block number
@@ -59,8 +70,156 @@ Disk::read(unsigned block_no, uint8_t *blk)
         std::cout << "Disk::write - ERROR: Invalid block number (" << block_no << ")\n";
         return -1;
     }
-    unsigned offset = block_no * BLOCK_SIZE;
-    diskfile.seekg(offset, std::ios_base::beg);
-    diskfile.read((char*)blk, BLOCK_SIZE);
+    off_t offset = (off_t)block_no * BLOCK_SIZE;
+    delay();
+    if (pread(fd, blk, BLOCK_SIZE, offset) != BLOCK_SIZE)
+        return -1;
+    if (!verify(block_no, blk))
+        return -2;
     return 0;
 }
+
+// reads <count> consecutive blocks starting at <block_no> with one call
+int
+Disk::read_run(unsigned block_no, unsigned count, uint8_t *blks)
+{
+    Span span("read run", block_no);
+    if (DEBUG)
+        std::cout << "Disk::read_run(" << block_no << "," << count << ")\n";
+    if (block_no >= no_blocks || count > no_blocks - block_no) {
+        std::cout << "Disk::read_run - ERROR: Invalid block range (" << block_no
+                  << "+" << count << ")\n";
+        return -1;
+    }
+    off_t offset = (off_t)block_no * BLOCK_SIZE;
+    size_t left = (size_t)count * BLOCK_SIZE;
+    uint8_t *p = blks;
+    delay();
+    while (left > 0) {
+        ssize_t n = pread(fd, p, left, offset);
+        if (n <= 0)
+            return -1;
+        p      += n;
+        offset += n;
+        left   -= n;
+    }
+    int ret = 0;
+    for (unsigned i = 0; i < count; i++) {
+        if (!verify(block_no + i, blks + (size_t)i * BLOCK_SIZE))
+            ret = -2;
+    }
+    return ret;
+}
+
+// writes <count> consecutive blocks starting at <block_no> with one call
+int
+Disk::write_run(unsigned block_no, unsigned count, const uint8_t *blks)
+{
+    Span span("write run", block_no);
+    if (DEBUG)
+        std::cout << "Disk::write_run(" << block_no << "," << count << ")\n";
+    if (block_no >= no_blocks || count > no_blocks - block_no) {
+        std::cout << "Disk::write_run - ERROR: Invalid block range (" << block_no
+                  << "+" << count << ")\n";
+        return -1;
+    }
+    off_t offset = (off_t)block_no * BLOCK_SIZE;
+    size_t left = (size_t)count * BLOCK_SIZE;
+    const uint8_t *start = blks;
+    delay();
+    while (left > 0) {
+        ssize_t n = pwrite(fd, blks, left, offset);
+        if (n <= 0)
+            return -1;
+        blks   += n;
+        offset += n;
+        left   -= n;
+    }
+    for (unsigned i = 0; i < count; i++) {
+        update(block_no + i, start + (size_t)i * BLOCK_SIZE);
+    }
+    return 0;
+}
+
+// punches <count> blocks starting at <block_no> out of the image file
+int
+Disk::discard(unsigned block_no, unsigned count)
+{
+    Span span("discard", block_no);
+    if (DEBUG)
+        std::cout << "Disk::discard(" << block_no << "," << count << ")\n";
+    if (block_no >= no_blocks || count > no_blocks - block_no) {
+        std::cout << "Disk::discard - ERROR: Invalid block range (" << block_no
+                  << "+" << count << ")\n";
+        return -1;
+    }
+    off_t offset = (off_t)block_no * BLOCK_SIZE;
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+                  (off_t)count * BLOCK_SIZE) != 0)
+        return -1;
+    // the punched blocks read back as zeros
+    static const uint8_t zeros[BLOCK_SIZE] = { 0 };
+    for (unsigned i = 0; i < count; i++) {
+        update(block_no + i, zeros);
+    }
+    return 0;
+}
+
+void
+Disk::set_checksums(std::atomic<uint32_t> *table, unsigned from, unsigned to)
+{
+    sums = table;
+    skip_from = from;
+    skip_to = to;
+}
+
+void
+Disk::delay()
+{
+    unsigned us = latency_us.load(std::memory_order_relaxed);
+    if (us != 0) {
+        std::this_thread::sleep_for(std::chrono::microseconds(us));
+    }
+}
+
+// records the checksum of the block just written
+void
+Disk::update(unsigned block_no, const uint8_t *blk)
+{
+    if (sums == nullptr || (block_no >= skip_from && block_no < skip_to))
+        return;
+    sums[block_no].store(crc32c(blk, BLOCK_SIZE), std::memory_order_relaxed);
+}
+
+// checks the block just read against its recorded checksum
+bool
+Disk::verify(unsigned block_no, const uint8_t *blk)
+{
+    if (sums == nullptr || (block_no >= skip_from && block_no < skip_to))
+        return true;
+    verified.fetch_add(1, std::memory_order_relaxed);
+    if (crc32c(blk, BLOCK_SIZE) == sums[block_no].load(std::memory_order_relaxed))
+        return true;
+    mismatches.fetch_add(1, std::memory_order_relaxed);
+    std::cout << "Disk::read - ERROR: Checksum mismatch in block " << block_no << "\n";
+    return false;
+}
+
+std::string
+scratch_image()
+{
+    const char *dir = std::getenv("TMPDIR");
+    std::string name = std::string(dir && *dir ? dir : "/tmp") + "/fsimageXXXXXX";
+    int fd = mkstemp(&name[0]);
+    if (fd >= 0) {
+        // a full-size sparse image, so Disk has nothing to create
+        if (ftruncate(fd, (off_t)BLOCK_SIZE * DISK_BLOCKS) != 0) {
+            unlink(name.c_str());
+            name.clear();
+        }
+        close(fd);
+    } else {
+        name.clear();
+    }
+    return name;
+}
@@ -1,22 +1,39 @@
 #include <iostream>
 #include <fstream>
 #include <cstdint>
+#include <atomic>
+#include <string>
 
 #ifndef __DISK_H__
 #define __DISK_H__
 
 #define DISKNAME "diskfile.bin"
 #define BLOCK_SIZE 4096
+// blocks in the image file
+#define DISK_BLOCKS 2048
 #define DEBUG false
 
 class Disk {
 private:
-    std::fstream diskfile;
-    const unsigned no_blocks = 2048;
+    // positional I/O on a raw descriptor, so several threads may read and
+    // write different blocks at the same time
+    int fd;
+    const unsigned no_blocks = DISK_BLOCKS;
     const unsigned disk_size = BLOCK_SIZE * no_blocks;
     bool disk_file_exists (const std::string& name);
+    // CRC-32C of every block, see set_checksums
+    std::atomic<uint32_t> *sums;
+    unsigned skip_from, skip_to;
+    std::atomic<uint64_t> verified;
+    std::atomic<uint64_t> mismatches;
+    std::atomic<unsigned> latency_us;
+    // waits out the simulated device latency of one call
+    void delay();
+    bool verify(unsigned block_no, const uint8_t *blk);
+    void update(unsigned block_no, const uint8_t *blk);
 public:
-    Disk();
+    // opens the image file <image>, creating it if it does not exist
+    Disk(const char *image = DISKNAME);
     ~Disk();
     unsigned get_no_blocks() { return no_blocks; }
     unsigned get_disk_size() { return disk_size; }
@@ -24,6 +41,29 @@ public:
     int write(unsigned block_no, uint8_t *blk);
     // reads one block from the disk
     int read(unsigned block_no, uint8_t *blk);
+    // reads <count> consecutive blocks starting at <block_no> with one call
+    int read_run(unsigned block_no, unsigned count, uint8_t *blks);
+    // writes <count> consecutive blocks starting at <block_no> with one call
+    int write_run(unsigned block_no, unsigned count, const uint8_t *blks);
+    // punches <count> blocks starting at <block_no> out of the image file,
+    // the host frees their storage and they read back as zeros
+    int discard(unsigned block_no, unsigned count);
+    // From now on every write records the checksum of the block in <sums>
+    // and every read checks it, failing with -2 on a mismatch. Blocks in
+    // [from, to), where the table itself is kept, are not checksummed.
+    // nullptr turns checking off.
+    void set_checksums(std::atomic<uint32_t> *sums, unsigned from = 0, unsigned to = 0);
+    // blocks checked by read and how many of them failed
+    uint64_t blocks_verified() { return verified.load(std::memory_order_relaxed); }
+    uint64_t checksum_errors() { return mismatches.load(std::memory_order_relaxed); }
+    void reset_counters() { verified = 0; mismatches = 0; }
+    // makes every read and write call take at least <us> microseconds
+    // more, to model a device slower than the page cache
+    void set_latency(unsigned us) { latency_us = us; }
 };
 
+// creates an empty image file in $TMPDIR (or /tmp) and returns its name,
+// "" on failure; for the tools that must not format the shell's image
+std::string scratch_image();
+
 #endif // __DISK_H__
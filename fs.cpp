@@ -1,330 +1,1704 @@
 #include <iostream>
 #include "fs.h"
+#include "pipeline.h"
+#include "trace.h"
+#include "stats.h"
+#include "simd.h"
+#include "lz.h"
+#include "crc32c.h"
 #include <cstring>
 #include <string>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
 
+const char *advice_names[ADV_COUNT] = {
+    "normal", "sequential", "random", "willneed", "dontneed"
+};
 
-FS::FS()
+int
+parse_advice(const std::string &name)
+{
+    for (int h = 0; h < ADV_COUNT; h++) {
+        if (name == advice_names[h]) {
+            return h;
+        }
+    }
+    return -1;
+}
+
+FS::FS(bool verbose, const char *image) : disk(image), cache(disk, &counters), stream_clock(0), verbose(verbose), pipelined(false), recorder(nullptr), batching(false),
+    fat_dirty(false), dir_dirty(false), avail(0), delayed(false), pending_bytes(0),
+    compressing(false), dedup(false), discard_stop(false), checksums(false),
+    scrub_running(false), scrub_ret(-3)
 {
-    std::cout << "FS::FS()... Creating file system\n";
+    if (verbose)
+        std::cout << "FS::FS()... Creating file system\n";
+    // the checksums come first so the FAT and the directory are checked
+    load_sums();
+    load_fat();
+    load_dir();
+    if (!checksums && fat[ROOT_BLOCK] == FAT_EOF && migrate_region() < 0) {
+        std::cout << "FS: cannot move files out of the checksum region, format the volume\n";
+    }
+    discarder = std::thread(&FS::discard_loop, this);
+    flusher = std::thread(&FS::flush_loop, this);
 }
 
 FS::~FS()
 {
+    if (scrubber.joinable()) {
+        scrubber.join();
+    }
+    {
+        std::lock_guard<std::mutex> guard(dir_lock);
+        flush_all_pending();
+    }
+    cache.stop_writeback();
+    flusher.join();
+    cache.writeback(true);
+    store_sums();
+    {
+        std::lock_guard<std::mutex> guard(discard_lock);
+        discard_stop = true;
+    }
+    discard_cond.notify_all();
+    discarder.join();
+}
 
+block_class
+FS::class_of(int blk)
+{
+    if (blk == ROOT_BLOCK) return BLK_DIR;
+    // the checksum region is counted with the FAT
+    if (blk >= FAT_BLOCK && blk < (int)FIRST_DATA_BLOCK) return BLK_FAT;
+    return BLK_DATA;
 }
 
-// formats the disk, i.e., creates an empty file system
 int
-FS::format()
+FS::read_block(int blk, uint8_t *buf, bool low)
 {
-    std::cout << "FS::format()\n";
+    block_class c = class_of(blk);
+    counters.read(c);
+    return c == BLK_DATA ? cache.read(blk, buf, low) : disk.read(blk, buf);
+}
 
-    for (int i = 0; i < BLOCK_SIZE / 2; i++) {
-        fat[i] = FAT_FREE;
+int
+FS::write_block(int blk, uint8_t *buf)
+{
+    block_class c = class_of(blk);
+    counters.write(c);
+    return c == BLK_DATA ? cache.write(blk, buf) : disk.write(blk, buf);
+}
+
+int
+FS::write_run(int blk, unsigned n, const uint8_t *buf)
+{
+    for (unsigned i = 0; i < n; i++) {
+        counters.write(BLK_DATA);
     }
-    fat[ROOT_BLOCK] = FAT_EOF;
-    fat[FAT_BLOCK]  = FAT_EOF;
+    return cache.write_run(blk, n, buf);
+}
+
+// reads the FAT from disk and rebuilds the allocation group summaries
+void
+FS::load_fat()
+{
+    uint8_t *p = reinterpret_cast<uint8_t*>(fat);
+    unsigned char fat_block[BLOCK_SIZE];
+    for (unsigned b = 0; b < FSGeometry::fat_blocks; b++) {
+        unsigned off = b * BLOCK_SIZE;
+        unsigned n = sizeof(fat) - off;
+        if (n > BLOCK_SIZE) n = BLOCK_SIZE;
+        if (read_block(FAT_BLOCK + b, fat_block) == 0) {
+            std::memcpy(p + off, fat_block, n);
+        } else {
+            std::memset(p + off, 0, n);
+        }
+    }
+    init_groups();
+}
 
+// writes the FAT to disk, copying one group at a time under its lock.
+// Inside a batch the write is held back until commit().
+void
+FS::store_fat()
+{
+    if (batching) {
+        fat_dirty = true;
+        return;
+    }
+    FSGeometry::fat_entry copy[FSGeometry::blocks];
+    std::memcpy(copy, fat, FIRST_DATA_BLOCK * sizeof(fat[0]));
+    for (int g = 0; g < ALLOC_GROUPS; g++) {
+        std::lock_guard<std::mutex> guard(groups[g].lock);
+        std::memcpy(copy + groups[g].first, fat + groups[g].first,
+                    (groups[g].last - groups[g].first) * sizeof(fat[0]));
+    }
+    uint8_t *p = reinterpret_cast<uint8_t*>(copy);
     unsigned char fat_block[BLOCK_SIZE];
-    std::memcpy(fat_block, fat, BLOCK_SIZE);
-    disk.write(FAT_BLOCK, fat_block);
+    for (unsigned b = 0; b < FSGeometry::fat_blocks; b++) {
+        unsigned off = b * BLOCK_SIZE;
+        unsigned n = sizeof(copy) - off;
+        if (n > BLOCK_SIZE) n = BLOCK_SIZE;
+        std::memset(fat_block, 0, BLOCK_SIZE);
+        std::memcpy(fat_block, p + off, n);
+        write_block(FAT_BLOCK + b, fat_block);
+    }
+    counters.flush();
+    store_sums();
+}
 
-    unsigned char dir_block[BLOCK_SIZE];
-    std::memset(dir_block, 0, BLOCK_SIZE);
-    disk.write(ROOT_BLOCK, dir_block);
+void
+FS::load_dir()
+{
+    if (read_block(ROOT_BLOCK, root) != 0) {
+        std::memset(root, 0, BLOCK_SIZE);
+    }
+    dir.load(reinterpret_cast<dir_entry*>(root));
+}
 
-    return 0;
+void
+FS::store_dir()
+{
+    if (batching) {
+        dir_dirty = true;
+        return;
+    }
+    if (pending.empty()) {
+        write_block(ROOT_BLOCK, root);
+    } else {
+        // delayed files have no blocks on disk yet, so they are stored empty
+        unsigned char copy[BLOCK_SIZE];
+        std::memcpy(copy, root, BLOCK_SIZE);
+        dir_entry *entries = reinterpret_cast<dir_entry*>(copy);
+        for (std::map<int, std::string>::iterator it = pending.begin(); it != pending.end(); ++it) {
+            entries[it->first].size = 0;
+        }
+        write_block(ROOT_BLOCK, copy);
+    }
+    counters.flush();
+    store_sums();
 }
 
-// create <filepath> creates a new file on the disk, the data content is
-// written on the following rows (ended with an empty row)
+// takes the checksums from the region if it is intact and turns checking on
+void
+FS::load_sums()
+{
+    uint32_t region[sizeof(sums_stored) / sizeof(uint32_t)];
+    uint8_t *p = reinterpret_cast<uint8_t*>(region);
+    for (unsigned b = 0; b < FSGeometry::csum_blocks; b++) {
+        if (read_block(FSGeometry::csum_block + b, p + b * BLOCK_SIZE) != 0) {
+            return;
+        }
+    }
+    if (!region_valid(region)) {
+        if (region[FSGeometry::csum_block] == CSUM_MAGIC)
+            std::cout << "FS: checksum region damaged, blocks are not verified\n";
+        return;
+    }
+    for (unsigned i = 0; i < FSGeometry::blocks; i++) {
+        sums[i] = region[i];
+    }
+    std::memcpy(sums_stored, region, sizeof(sums_stored));
+    checksums = true;
+    disk.set_checksums(sums, FSGeometry::csum_block, FIRST_DATA_BLOCK);
+}
+
+// A volume formatted before the checksum region existed may keep file
+// blocks where the region is now. Each such block is copied to a free data
+// block and relinked, then the region is reserved. The volume stays
+// without checksums until it is formatted. Returns 1 if anything moved,
+// 0 if not, -4 or -5 if a block could not be moved; the FAT and the
+// directory are then reloaded as they are on disk. Called before any other
+// thread runs.
 int
-FS::create(std::string filepath)
+FS::migrate_region()
+{
+    dir_entry *entries = reinterpret_cast<dir_entry*>(root);
+    bool moved = false, changed = false;
+    for (unsigned b = FSGeometry::csum_block; b < FIRST_DATA_BLOCK; b++) {
+        bool used = dir.refs(b) != 0;
+        for (unsigned p = 0; p < FSGeometry::blocks && !used; p++) {
+            used = fat[p] == (int)b;
+        }
+        if (!used) {
+            changed |= fat[b] != FAT_EOF;
+            fat[b] = FAT_EOF;
+            continue;
+        }
+        int nb = fat_find_free(fat, FIRST_DATA_BLOCK, FSGeometry::blocks);
+        uint8_t blk[BLOCK_SIZE];
+        if (nb == -1 || disk.read(b, blk) != 0 || disk.write(nb, blk) != 0) {
+            load_fat();
+            load_dir();
+            return nb == -1 ? -5 : -4;
+        }
+        fat[nb] = fat[b];
+        fat[b] = FAT_EOF;
+        for (unsigned p = 0; p < FSGeometry::blocks; p++) {
+            if (fat[p] == (int)b) {
+                fat[p] = nb;
+            }
+        }
+        for (uint64_t u = dir.used; u; u &= u - 1) {
+            int i = __builtin_ctzll(u);
+            if (entries[i].first_blk == b) {
+                entries[i].first_blk = nb;
+                dir.update(entries, i);
+            }
+        }
+        moved = changed = true;
+    }
+    if (changed) {
+        init_groups();
+        store_dir();
+        store_fat();
+    }
+    if (moved) {
+        std::cout << "FS: moved files out of the checksum region of an old volume\n";
+    }
+    return moved;
+}
+
+// writes the blocks of the checksum region whose contents changed
+void
+FS::store_sums()
 {
-std::cout << "FS::create(" << filepath << ")\n";
+    std::lock_guard<std::mutex> guard(sums_lock);
+    if (!checksums) {
+        return;
+    }
+    uint32_t region[sizeof(sums_stored) / sizeof(uint32_t)];
+    std::memset(region, 0, sizeof(region));
+    for (unsigned i = 0; i < FSGeometry::blocks; i++) {
+        region[i] = sums[i].load(std::memory_order_relaxed);
+    }
+    seal_region(region);
+    uint8_t *p = reinterpret_cast<uint8_t*>(region);
+    uint8_t *stored = reinterpret_cast<uint8_t*>(sums_stored);
+    for (unsigned b = 0; b < FSGeometry::csum_blocks; b++) {
+        unsigned off = b * BLOCK_SIZE;
+        if (std::memcmp(p + off, stored + off, BLOCK_SIZE) != 0) {
+            write_block(FSGeometry::csum_block + b, p + off);
+            std::memcpy(stored + off, p + off, BLOCK_SIZE);
+        }
+    }
+}
 
-    if (filepath.find('/') != std::string::npos) {
-        return -1;
+void
+FS::seal_region(uint32_t *region)
+{
+    region[FSGeometry::csum_block] = CSUM_MAGIC;
+    region[FSGeometry::csum_block + 1] = 0;
+    region[FSGeometry::csum_block + 1] =
+        crc32c(region, FSGeometry::csum_blocks * BLOCK_SIZE);
+}
+
+// the CRC is taken with its own entry as zero
+bool
+FS::region_valid(const uint32_t *region)
+{
+    if (region[FSGeometry::csum_block] != CSUM_MAGIC) {
+        return false;
     }
+    const unsigned at = FSGeometry::csum_block + 1;
+    const uint32_t zero = 0;
+    uint32_t c = crc32c(region, at * sizeof(uint32_t));
+    c = crc32c(&zero, sizeof(zero), c);
+    c = crc32c(region + at + 1, FSGeometry::csum_blocks * BLOCK_SIZE - (at + 1) * sizeof(uint32_t), c);
+    return c == region[at];
+}
 
-    unsigned char fat_block[BLOCK_SIZE];
-    if (disk.read(FAT_BLOCK, fat_block) == 0) {
-        std::memcpy(fat, fat_block, BLOCK_SIZE);
+void
+FS::init_groups()
+{
+    long total = 0;
+    for (int g = 0; g < ALLOC_GROUPS; g++) {
+        alloc_group &grp = groups[g];
+        std::lock_guard<std::mutex> guard(grp.lock);
+        grp.first = FIRST_DATA_BLOCK + g * GROUP_SIZE;
+        grp.last  = grp.first + GROUP_SIZE;
+        if (grp.last > FSGeometry::blocks) {
+            grp.last = FSGeometry::blocks;
+        }
+        grp.nfree = fat_count_free(fat, grp.first, grp.last);
+        int first_free = fat_find_free(fat, grp.first, grp.last);
+        grp.hint  = first_free == -1 ? grp.last : first_free;
+        total += grp.nfree;
     }
+    // called when no file is pending, so nothing is reserved
+    avail = total;
+}
 
-    unsigned char dir_block[BLOCK_SIZE];
-    if (disk.read(ROOT_BLOCK, dir_block) != 0) {
-        return -2;
+int
+FS::group_of(int blk)
+{
+    return (blk - FIRST_DATA_BLOCK) / GROUP_SIZE;
+}
+
+// every thread gets a home group the first time it allocates
+int
+FS::home_group()
+{
+    static std::atomic<unsigned> next_group(0);
+    static thread_local int home = -1;
+    if (home == -1) {
+        home = next_group++ % ALLOC_GROUPS;
     }
-    dir_entry *entries = reinterpret_cast<dir_entry*>(dir_block);
-    int n = BLOCK_SIZE / sizeof(dir_entry);
+    return home;
+}
 
-    for (int i = 0; i < n; i++) {
-        if (entries[i].file_name[0] != '\0' &&
-            filepath == entries[i].file_name) {
-            return -3;
+int
+FS::alloc_block(int near, bool reserved)
+{
+    // blocks promised to delayed files are not handed out to others
+    if (!reserved && avail.fetch_sub(1) <= 0) {
+        avail++;
+        return -1;
+    }
+    int start = (near >= (int)FIRST_DATA_BLOCK) ? group_of(near) : home_group();
+    uint64_t scanned = 0;
+    for (int k = 0; k < ALLOC_GROUPS; k++) {
+        alloc_group &grp = groups[(start + k) % ALLOC_GROUPS];
+        std::lock_guard<std::mutex> guard(grp.lock);
+        if (grp.nfree == 0) {
+            continue;
         }
+        int i = fat_find_free(fat, grp.hint, grp.last);
+        if (i != -1) {
+            counters.alloc(scanned + i - grp.hint + 1);
+            fat[i] = FAT_EOF;
+            grp.nfree--;
+            grp.hint = i + 1;
+            return i;
+        }
+        scanned += grp.last - grp.hint;
+    }
+    if (!reserved) {
+        avail++;
     }
+    return -1;
+}
 
-    int free_index = -1;
-    for (int i = 0; i < n; i++) {
-        if (entries[i].file_name[0] == '\0') {
-            free_index = i;
-            break;
+int
+FS::alloc_run(unsigned n)
+{
+    // a run may cross groups, so all of them are locked, in order
+    std::unique_lock<std::mutex> locks[ALLOC_GROUPS];
+    for (int g = 0; g < ALLOC_GROUPS; g++) {
+        locks[g] = std::unique_lock<std::mutex>(groups[g].lock);
+    }
+    int first = fat_find_free_run(fat, FIRST_DATA_BLOCK, FSGeometry::blocks, n);
+    if (first == -1) {
+        return -1;
+    }
+    for (unsigned i = 0; i < n; i++) {
+        unsigned b = first + i;
+        fat[b] = (i + 1 < n) ? static_cast<int16_t>(b + 1) : FAT_EOF;
+        alloc_group &grp = groups[group_of(b)];
+        grp.nfree--;
+        if (grp.hint == b) {
+            grp.hint = b + 1;
         }
     }
-    if (free_index == -1) {
-        return -4;
+    counters.alloc(n);
+    return first;
+}
+
+bool
+FS::reserve(unsigned n)
+{
+    long a = avail.load();
+    do {
+        if (a < (long)n) {
+            return false;
+        }
+    } while (!avail.compare_exchange_weak(a, a - n));
+    return true;
+}
+
+void
+FS::unreserve(unsigned n)
+{
+    avail += n;
+}
+
+void
+FS::set_fat(int blk, int16_t value)
+{
+    std::lock_guard<std::mutex> guard(groups[group_of(blk)].lock);
+    fat[blk] = value;
+}
+
+// returns every block in the chain starting at <blk> to its group and
+// queues it to be punched out of the image
+void
+FS::free_chain(int blk)
+{
+    if (blk >= (int)FIRST_DATA_BLOCK) {
+        std::lock_guard<std::mutex> guard(ra_lock);
+        hints.erase(blk);
+        streams.erase(blk);
+    }
+    std::vector<int> freed;
+    while (blk >= (int)FIRST_DATA_BLOCK && blk < (int)FSGeometry::blocks) {
+        alloc_group &grp = groups[group_of(blk)];
+        std::lock_guard<std::mutex> guard(grp.lock);
+        int next = LINK_BLOCK(fat[blk]);
+        // dropped before the block can be allocated again or punched, the
+        // data a write-back has in flight lands first
+        cache.invalidate(blk, true);
+        fat[blk] = FAT_FREE;
+        grp.nfree++;
+        avail++;
+        if ((unsigned)blk < grp.hint) {
+            grp.hint = blk;
+        }
+        freed.push_back(blk);
+        blk = next;
+    }
+    if (freed.empty()) {
+        return;
     }
+    {
+        std::lock_guard<std::mutex> guard(discard_lock);
+        discards.insert(discards.end(), freed.begin(), freed.end());
+    }
+    discard_cond.notify_one();
+}
 
-    std::cout << "Enter data. Empty line to end.\n";
-    std::string data;
-    std::string line;
+// background thread: collects freed blocks for DISCARD_DELAY_MS, then
+// punches them as sorted runs
+void
+FS::discard_loop()
+{
+    std::unique_lock<std::mutex> guard(discard_lock);
     while (true) {
-        if (!std::getline(std::cin, line)) {
-            break;
+        while (!discard_stop && discards.empty()) {
+            discard_cond.wait(guard);
         }
-        if (line.empty()) {
-            break;
+        if (discards.empty()) {
+            return;
         }
-        data += line;
-        data += '\n';
+        if (!discard_stop) {
+            discard_cond.wait_for(guard, std::chrono::milliseconds(DISCARD_DELAY_MS));
+        }
+        std::vector<int> batch;
+        batch.swap(discards);
+        guard.unlock();
+        discard_blocks(batch);
+        guard.lock();
     }
+}
 
-    uint32_t size = static_cast<uint32_t>(data.size());
-    uint16_t first_blk = 0;
-
-    if (size > 0) {
-        const char *p = data.c_str();
-        uint32_t left = size;
-        int prev = -1;
+// background thread: writes back the dirty blocks as they come due, then
+// the checksums of the blocks written
+void
+FS::flush_loop()
+{
+    while (cache.wait_writeback()) {
+        if (cache.writeback(false) > 0) {
+            store_sums();
+        }
+    }
+}
 
-        while (left > 0) {
-            int b = -1;
-            for (int i = 2; i < BLOCK_SIZE / 2; i++) {
-                if (fat[i] == FAT_FREE) {
-                    b = i;
-                    break;
-                }
+// A block may have been allocated again since it was queued, and its new
+// owner writes it outside the group lock. Holding the lock while checking
+// FAT_FREE and punching keeps the punch ahead of any such write.
+void
+FS::discard_blocks(std::vector<int> &blocks)
+{
+    std::sort(blocks.begin(), blocks.end());
+    blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+    size_t k = 0;
+    while (k < blocks.size()) {
+        int g = group_of(blocks[k]);
+        std::lock_guard<std::mutex> guard(groups[g].lock);
+        for (; k < blocks.size() && group_of(blocks[k]) == g; k++) {
+            if (fat[blocks[k]] != FAT_FREE) {
+                continue;
+            }
+            unsigned first = blocks[k], n = 1;
+            while (k + 1 < blocks.size() && blocks[k + 1] == (int)(first + n) &&
+                   group_of(blocks[k + 1]) == g && fat[blocks[k + 1]] == FAT_FREE) {
+                k++;
+                n++;
             }
+            if (disk.discard(first, n) == 0) {
+                counters.discard(n);
+            }
+        }
+    }
+    // punched blocks have the checksum of zeros now
+    store_sums();
+}
+
+int
+FS::extend_chain(int tail, unsigned n, int &first)
+{
+    first = -1;
+    if (n == 0) {
+        return 0;
+    }
+    if (!reserve(n)) {
+        return -5;
+    }
+    first = alloc_run(n);
+    if (first == -1) {
+        int prev = -1;
+        for (unsigned k = 0; k < n; k++) {
+            int b = alloc_block(prev, true);
             if (b == -1) {
+                free_chain(first);
+                unreserve(n - k);
+                first = -1;
                 return -5;
             }
+            if (first == -1) first = b;
+            if (prev != -1) set_fat(prev, static_cast<int16_t>(b));
+            prev = b;
+        }
+    }
+    if (tail != -1) {
+        set_fat(tail, static_cast<int16_t>(first));
+    }
+    return 0;
+}
 
-            if (first_blk == 0) {
-                first_blk = static_cast<uint16_t>(b);
-            }
-            if (prev != -1) {
-                fat[prev] = static_cast<int16_t>(b);
-            }
+unsigned
+FS::chain_length(int blk)
+{
+    unsigned n = 0;
+    while (blk >= (int)FIRST_DATA_BLOCK && blk < (int)FSGeometry::blocks) {
+        n++;
+        blk = LINK_BLOCK(fat[blk]);
+    }
+    return n;
+}
 
-            unsigned char data_block[BLOCK_SIZE];
-            std::memset(data_block, 0, BLOCK_SIZE);
-            uint32_t to_copy = (left > BLOCK_SIZE) ? BLOCK_SIZE : left;
-            std::memcpy(data_block, p, to_copy);
-            disk.write(b, data_block);
+int
+FS::find_entry(dir_entry *entries, const std::string &name)
+{
+    if (name.find('\0') != std::string::npos) {
+        return -1;
+    }
+    return dir.find(entries, name.data(), name.size());
+}
 
-            left -= to_copy;
-            p    += to_copy;
-            prev  = b;
-        }
+int
+FS::find_entry(dir_entry *entries, const char *name, size_t len)
+{
+    return dir.find(entries, name, len);
+}
 
-        if (prev != -1) {
-            fat[prev] = FAT_EOF;
+int
+FS::free_entry()
+{
+    return dir.free_slot();
+}
+
+// pins are taken and dropped with dir_lock held
+void
+FS::pin(uint16_t blk)
+{
+    if (blk != 0) {
+        pins[blk]++;
+    }
+}
+
+void
+FS::unpin(uint16_t blk)
+{
+    if (blk == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(dir_lock);
+    std::map<uint16_t, int>::iterator it = pins.find(blk);
+    if (it != pins.end() && --it->second == 0) {
+        pins.erase(it);
+        unpinned.notify_all();
+    }
+}
+
+bool
+FS::pinned(uint16_t blk)
+{
+    return blk != 0 && pins.count(blk) != 0;
+}
+
+void
+FS::chain_blocks(int blk, uint32_t size, std::vector<int> &blocks)
+{
+    uint32_t n = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    blocks.clear();
+    ChainCursor c(fat, blk);
+    while (blocks.size() < n && (c.block() == HOLE_BLOCK || c.block() >= (int)FIRST_DATA_BLOCK)) {
+        blocks.push_back(c.block());
+        c.next();
+    }
+}
+
+// Block <k> continues a stream if it follows the block read last, a read
+// from the start of a file starts one
+void
+FS::readahead(uint16_t first, uint32_t k, uint32_t nblocks, ChainCursor c)
+{
+    uint32_t from, to;
+    int hint;
+    {
+        std::lock_guard<std::mutex> guard(ra_lock);
+        std::map<uint16_t, int>::iterator h = hints.find(first);
+        hint = h == hints.end() ? ADV_NORMAL : h->second;
+        if (hint == ADV_RANDOM) {
+            return;
+        }
+        std::map<uint16_t, ra_stream>::iterator it = streams.find(first);
+        if (it == streams.end()) {
+            if (streams.size() >= RA_STREAMS) {
+                std::map<uint16_t, ra_stream>::iterator old = streams.begin();
+                for (it = streams.begin(); it != streams.end(); ++it) {
+                    if (it->second.used < old->second.used) old = it;
+                }
+                streams.erase(old);
+            }
+            ra_stream fresh = { 0, 0, 0, 0 };
+            it = streams.insert(std::make_pair(first, fresh)).first;
+        }
+        ra_stream &s = it->second;
+        s.used = ++stream_clock;
+        // a sequential file is read ahead wherever the reads go
+        bool sequential = k == s.next || k == 0 || hint == ADV_SEQUENTIAL;
+        s.next = k + 1;
+        if (!sequential) {
+            s.window = 0;
+            s.ahead = k + 1;
+            return;
+        }
+        if (k == 0) {
+            s.window = 0;
         }
+        // more than half a window is still ahead of the reader
+        if (s.window != 0 && k + s.window / 2 < s.ahead) {
+            return;
+        }
+        if (hint == ADV_SEQUENTIAL) {
+            // the largest window at once, and twice the usual one
+            s.window = s.window == 0 ? RA_MAX : std::min(2 * s.window, 2u * RA_MAX);
+        } else {
+            s.window = s.window == 0 ? RA_MIN : std::min(2 * s.window, (unsigned)RA_MAX);
+        }
+        from = std::max(s.ahead, k + 1);
+        to = std::min(k + 1 + s.window, nblocks);
+        if (from >= to) {
+            return;
+        }
+        s.ahead = to;
+    }
+    for (uint32_t i = k; i < from; i++) {
+        c.next();
+    }
+    std::vector<int> blocks;
+    for (uint32_t i = from; i < to; i++) {
+        if (c.block() >= (int)FIRST_DATA_BLOCK) {
+            blocks.push_back(c.block());
+        } else if (c.block() != HOLE_BLOCK) {
+            break;
+        }
+        c.next();
+    }
+    cache.prefetch(blocks, scan_hint(hint));
+}
 
-        std::memcpy(fat_block, fat, BLOCK_SIZE);
-        disk.write(FAT_BLOCK, fat_block);
+int
+FS::hint_of(uint16_t first)
+{
+    std::lock_guard<std::mutex> guard(ra_lock);
+    std::map<uint16_t, int>::iterator h = hints.find(first);
+    return h == hints.end() ? ADV_NORMAL : h->second;
+}
+
+// checks that <filepath> can be added to the root directory
+int
+FS::check_new(const std::string &filepath)
+{
+    if (filepath.find('/') != std::string::npos) {
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> guard(dir_lock);
+    dir_entry *entries = reinterpret_cast<dir_entry*>(root);
+    if (find_entry(entries, filepath) != -1) {
+        return -3;
+    }
+    if (free_entry() == -1) {
+        return -4;
     }
+    return 0;
+}
 
-    dir_entry &e = entries[free_index];
+void
+FS::link_entry(int i, const std::string &filepath, uint32_t size, uint16_t first_blk,
+               uint8_t rights, uint8_t type)
+{
+    dir_entry *entries = reinterpret_cast<dir_entry*>(root);
+    dir_entry &e = entries[i];
     std::memset(&e, 0, sizeof(dir_entry));
     std::strncpy(e.file_name, filepath.c_str(), sizeof(e.file_name) - 1);
     e.file_name[sizeof(e.file_name) - 1] = '\0';
     e.size      = size;
     e.first_blk = first_blk;
-    e.type      = TYPE_FILE;
-    e.access_rights = READ | WRITE;
+    e.type      = type;
+    e.access_rights = rights;
+    dir.update(entries, i);
+}
+
+static unsigned
+blocks_for(uint32_t size)
+{
+    return (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+// blocks promised to a delayed file of <size> bytes: a compressed one may
+// take its chunk table more than its data when no chunk shrinks
+static unsigned
+reserve_for(uint32_t size, uint8_t type)
+{
+    if (type & TYPE_COMPRESSED) {
+        return blocks_for(size + 2 * blocks_for(size));
+    }
+    return blocks_for(size);
+}
+
+// a block of zeros at <done> that is neither the first nor the last of a
+// file is left as a hole, as long as the link can count one more
+bool
+FS::skip_block(const char *chunk, uint32_t done, uint32_t size, unsigned holes)
+{
+    if (done == 0 || size - done <= BLOCK_SIZE || holes == FSGeometry::max_holes) {
+        return false;
+    }
+    return chunk[0] == 0 && std::memcmp(chunk, chunk + 1, BLOCK_SIZE - 1) == 0;
+}
+
+// writes <size> bytes to newly allocated blocks, the blocks are private to
+// the caller until they are linked into the directory by add_entry().
+// -5 if the disk is full, -6 if a block cannot be written.
+int
+FS::write_chain(const char *data, uint32_t size, uint16_t &first_blk)
+{
+    first_blk = 0;
+    uint32_t left = size;
+    int prev = -1;
+    unsigned holes = 0;
+
+    while (left > 0) {
+        if (skip_block(data, size - left, size, holes)) {
+            holes++;
+            left -= BLOCK_SIZE;
+            data += BLOCK_SIZE;
+            continue;
+        }
+        int b = alloc_block(prev);
+        if (b == -1) {
+            free_chain(first_blk);
+            first_blk = 0;
+            return -5;
+        }
+
+        if (first_blk == 0) {
+            first_blk = static_cast<uint16_t>(b);
+        }
+        if (prev != -1) {
+            set_fat(prev, static_cast<int16_t>(MAKE_LINK(b, holes)));
+        }
+        holes = 0;
+
+        unsigned char data_block[BLOCK_SIZE];
+        std::memset(data_block, 0, BLOCK_SIZE);
+        uint32_t to_copy = (left > BLOCK_SIZE) ? BLOCK_SIZE : left;
+        std::memcpy(data_block, data, to_copy);
+        if (write_block(b, data_block) != 0) {
+            free_chain(first_blk);
+            first_blk = 0;
+            return -6;
+        }
+
+        left -= to_copy;
+        data += to_copy;
+        prev  = b;
+    }
+    counters.data_written(size);
+    return 0;
+}
+
+// links a chain written by write_chain() into the root directory, the name
+// checks are repeated since other threads may have raced us
+int
+FS::add_entry(const std::string &filepath, uint32_t size, uint16_t first_blk, uint8_t rights,
+              uint8_t type, const char *delayed_data)
+{
+    std::lock_guard<std::mutex> guard(dir_lock);
+    int ret = 0;
+    dir_entry *entries = reinterpret_cast<dir_entry*>(root);
+    int free_index = -1;
+    if (find_entry(entries, filepath) != -1) {
+        ret = -3;
+    } else if ((free_index = free_entry()) == -1) {
+        ret = -4;
+    }
+    if (ret != 0) {
+        free_chain(first_blk);
+        return ret;
+    }
+
+    if (first_blk != 0) {
+        store_fat();
+    }
+
+    link_entry(free_index, filepath, size, first_blk, rights, type);
+    if (delayed_data) {
+        pending[free_index].assign(delayed_data, size);
+        pending_bytes += size;
+    }
+
+    store_dir();
+    if (pending_bytes > DELAYED_MAX) {
+        flush_all_pending();
+    }
+    return 0;
+}
+
+// 64-bit hash of file contents, eight bytes at a time
+static uint64_t
+content_hash(const char *data, uint32_t size)
+{
+    uint64_t h = 0x9e3779b97f4a7c15ull ^ size;
+    uint32_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t v;
+        std::memcpy(&v, data + i, 8);
+        h = (h ^ v) * 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, data + i, size - i);
+    h = (h ^ tail) * 0xc4ceb9fe1a85ec53ull;
+    return h ^ (h >> 29);
+}
+
+int
+FS::store_file(const std::string &filepath, const char *data, uint32_t size)
+{
+    new_file f;
+    int ret = begin_file(filepath, data, size, f);
+    if (ret != 0 || f.done) {
+        return ret;
+    }
+    uint16_t first_blk = 0;
+    ret = store_chain(data, size, f.type, first_blk);
+    if (ret != 0) {
+        return ret;
+    }
+    return finish_file(filepath, size, first_blk, f);
+}
+
+int
+FS::begin_file(const std::string &filepath, const char *data, uint32_t size, new_file &f)
+{
+    f.type = compressing ? TYPE_FILE | TYPE_COMPRESSED : TYPE_FILE;
+    f.hash = 0;
+    f.done = true;
+    if (dedup && size > 0) {
+        f.hash = content_hash(data, size);
+        std::lock_guard<std::mutex> guard(dir_lock);
+        uint16_t first_blk = find_dup(f.hash, data, size, f.type);
+        if (first_blk != 0) {
+            dir_entry *entries = reinterpret_cast<dir_entry*>(root);
+            if (find_entry(entries, filepath) != -1) {
+                return -3;
+            }
+            int i = free_entry();
+            if (i == -1) {
+                return -4;
+            }
+            link_entry(i, filepath, size, first_blk, READ | WRITE, f.type);
+            counters.data_deduped(size);
+            store_dir();
+            return 0;
+        }
+    }
+    if (delayed && size > 0) {
+        // the blocks are promised now so the flush cannot run out of space
+        unsigned n = reserve_for(size, f.type);
+        if (!reserve(n)) {
+            return -5;
+        }
+        int ret = add_entry(filepath, size, 0, READ | WRITE, f.type, data);
+        if (ret != 0) {
+            unreserve(n);
+        }
+        return ret;
+    }
+    f.done = false;
+    return 0;
+}
+
+int
+FS::finish_file(const std::string &filepath, uint32_t size, uint16_t first_blk,
+                const new_file &f)
+{
+    int ret = add_entry(filepath, size, first_blk, READ | WRITE, f.type);
+    if (ret == 0 && dedup && first_blk != 0) {
+        std::lock_guard<std::mutex> guard(dir_lock);
+        dedup_index.insert(std::make_pair(f.hash, first_blk));
+    }
+    return ret;
+}
+
+int
+FS::store_chain(const char *data, uint32_t size, uint8_t type, uint16_t &first_blk)
+{
+    if (!(type & TYPE_COMPRESSED)) {
+        return write_chain(data, size, first_blk);
+    }
+    std::string stream;
+    pack(data, size, stream);
+    return write_chain(stream.data(), stream.size(), first_blk);
+}
+
+uint16_t
+FS::find_dup(uint64_t hash, const char *data, uint32_t size, uint8_t type)
+{
+    dir_entry *entries = reinterpret_cast<dir_entry*>(root);
+    std::vector<char> buf;
+    typedef std::multimap<uint64_t, uint16_t>::iterator iter;
+    std::pair<iter, iter> range = dedup_index.equal_range(hash);
+    for (iter it = range.first; it != range.second; ) {
+        int i = dir.find_chain(it->second);
+        if (i == -1) {
+            // the file is gone
+            it = dedup_index.erase(it);
+            continue;
+        }
+        const dir_entry &e = entries[i];
+        if (e.size == size && e.type == type && pending.count(i) == 0) {
+            buf.resize(size);
+            if (read_data(e, buf.data(), size, 0) == 0 &&
+                std::memcmp(buf.data(), data, size) == 0) {
+                return it->second;
+            }
+        }
+        ++it;
+    }
+    return 0;
+}
+
+void
+FS::release_chain(uint16_t first_blk)
+{
+    if (first_blk == 0 || dir.refs(first_blk) > 0) {
+        return;
+    }
+    if (batching) {
+        // the blocks may only be reused once the directory entry that
+        // still references them on disk has been replaced
+        deferred.push_back(first_blk);
+    } else {
+        free_chain(first_blk);
+    }
+}
+
+int
+FS::unshare(int i)
+{
+    dir_entry *entries = reinterpret_cast<dir_entry*>(root);
+    dir_entry &e = entries[i];
+    if (e.first_blk == 0 || dir.refs(e.first_blk) < 2) {
+        return 0;
+    }
+    std::vector<char> data(e.size);
+    if (e.size > 0 && read_data(e, data.data(), e.size, 0) != 0) {
+        return -5;
+    }
+    uint16_t first_blk;
+    if (store_chain(data.data(), e.size, e.type, first_blk) != 0) {
+        return -4;
+    }
+    e.first_blk = first_blk;
+    dir.update(entries, i);
+    store_fat();
+    store_dir();
+    return 0;
+}
+
+// Compressed files: the chain holds a table of u16 lengths, one per
+// BLOCK_SIZE chunk of data, followed by the compressed chunks
+void
+FS::pack(const char *data, uint32_t size, std::string &stream)
+{
+    unsigned chunks = blocks_for(size);
+    stream.assign(chunks * 2, '\0');
+    uint8_t out[BLOCK_SIZE];
+    for (unsigned k = 0; k < chunks; k++) {
+        const char *p = data + k * BLOCK_SIZE;
+        uint32_t len = size - k * BLOCK_SIZE;
+        if (len > BLOCK_SIZE) len = BLOCK_SIZE;
+        // a chunk that does not shrink is stored as is
+        int c = lz_compress(reinterpret_cast<const uint8_t*>(p), len, out, len - 1);
+        uint16_t v;
+        if (c > 0) {
+            stream.append(reinterpret_cast<char*>(out), c);
+            v = c;
+        } else {
+            stream.append(p, len);
+            v = len | CHUNK_RAW;
+        }
+        stream[2 * k] = v & 0xff;
+        stream[2 * k + 1] = v >> 8;
+    }
+}
+
+int
+FS::place_pending(int index)
+{
+    std::map<int, std::string>::iterator it = pending.find(index);
+    if (it == pending.end()) {
+        return 0;
+    }
+    dir_entry *entries = reinterpret_cast<dir_entry*>(root);
+    uint32_t logical = it->second.size();
+    unsigned reserved = reserve_for(logical, entries[index].type);
+    std::string packed;
+    if (entries[index].type & TYPE_COMPRESSED) {
+        pack(it->second.data(), logical, packed);
+    }
+    std::string &data = (entries[index].type & TYPE_COMPRESSED) ? packed : it->second;
+    uint32_t size = data.size();
+    unsigned n = blocks_for(size);
+
+    // zero blocks become holes and give back their reservation
+    unsigned holes = 0, skipped = 0;
+    for (uint32_t done = 0; done < size; done += BLOCK_SIZE) {
+        if (skip_block(data.data() + done, done, size, holes)) {
+            holes++;
+            skipped++;
+        } else {
+            holes = 0;
+        }
+    }
 
-    disk.write(ROOT_BLOCK, dir_block);
+    // one run and one write when the free space allows it
+    int first = skipped == 0 ? alloc_run(n) : -1;
+    if (first != -1) {
+        data.resize((size_t)n * BLOCK_SIZE, '\0');
+        write_run(first, n, reinterpret_cast<const uint8_t*>(data.data()));
+    } else {
+        int prev = -1;
+        unsigned taken = 0;
+        holes = 0;
+        unsigned char data_block[BLOCK_SIZE];
+        for (uint32_t done = 0; done < size; done += BLOCK_SIZE) {
+            if (skip_block(data.data() + done, done, size, holes)) {
+                holes++;
+                continue;
+            }
+            int b = alloc_block(prev, true);
+            if (b == -1) {
+                // the blocks came out of the reservation, which the file
+                // still holds, so the credit free_chain gives is taken back
+                // first; avail is never higher than the truth
+                avail -= taken;
+                free_chain(first);
+                return -5;
+            }
+            taken++;
+            if (first == -1) first = b;
+            if (prev != -1) set_fat(prev, static_cast<int16_t>(MAKE_LINK(b, holes)));
+            holes = 0;
+            uint32_t len = (size - done > BLOCK_SIZE) ? BLOCK_SIZE : size - done;
+            std::memset(data_block, 0, BLOCK_SIZE);
+            std::memcpy(data_block, data.data() + done, len);
+            write_block(b, data_block);
+            prev = b;
+        }
+    }
+    // compression and holes may need fewer blocks than were promised
+    unreserve(reserved - n + skipped);
+    counters.data_written(size);
+
+    entries[index].first_blk = static_cast<uint16_t>(first);
+    dir.update(entries, index);
+    if (dedup) {
+        dedup_index.insert(std::make_pair(content_hash(it->second.data(), logical), first));
+    }
+    pending_bytes -= logical;
+    pending.erase(it);
+    return 0;
+}
+
+int
+FS::flush_pending(int index)
+{
+    if (pending.count(index) == 0) {
+        return 0;
+    }
+    int ret = place_pending(index);
+    store_fat();
+    store_dir();
+    return ret;
+}
+
+int
+FS::flush_all_pending()
+{
+    if (pending.empty()) {
+        return 0;
+    }
+    int ret = 0;
+    while (!pending.empty() && ret == 0) {
+        ret = place_pending(pending.begin()->first);
+    }
+    store_fat();
+    store_dir();
+    return ret;
+}
+
+void
+FS::set_delayed(bool on)
+{
+    std::lock_guard<std::mutex> guard(dir_lock);
+    delayed = on;
+    if (!on) {
+        flush_all_pending();
+    }
+}
+
+void
+FS::set_compression(bool on)
+{
+    std::lock_guard<std::mutex> guard(dir_lock);
+    compressing = on;
+}
+
+void
+FS::set_dedup(bool on)
+{
+    std::lock_guard<std::mutex> guard(dir_lock);
+    dedup = on;
+}
+
+void
+FS::set_writeback(bool on)
+{
+    cache.set_writeback(on);
+    if (!on) {
+        store_sums();
+    }
+}
+
+// sync gives every delayed file its blocks and writes it, and every dirty
+// block of the cache
+int
+FS::sync()
+{
+    OpTimer timer(counters, OP_SYNC);
+    if (recorder) recorder->record(OP_SYNC);
+
+    std::lock_guard<std::mutex> guard(dir_lock);
+    int ret = flush_all_pending();
+    cache.writeback(true);
+    store_sums();
+    return ret;
+}
+
+// formats the disk, i.e., creates an empty file system
+int
+FS::format()
+{
+    OpTimer timer(counters, OP_FORMAT);
+    if (verbose)
+        std::cout << "FS::format()\n";
+    if (recorder) recorder->record(OP_FORMAT);
+
+    std::unique_lock<std::mutex> guard(dir_lock);
+    // readers and copies in flight finish with the chains they pinned
+    while (!pins.empty()) {
+        unpinned.wait(guard);
+    }
+    // the whole image becomes a hole, queued discards are covered by it
+    {
+        std::lock_guard<std::mutex> dguard(discard_lock);
+        discards.clear();
+    }
+    // write-backs in flight land before the punch, dirty blocks are dropped
+    cache.clear();
+    // the punch, or else the zeros written, records the checksum of every
+    // block; older volumes get their checksum region
+    {
+        std::lock_guard<std::mutex> sguard(sums_lock);
+        // nothing of the region is known to be on the disk
+        std::memset(sums_stored, 0xff, sizeof(sums_stored));
+        disk.set_checksums(sums, FSGeometry::csum_block, FIRST_DATA_BLOCK);
+    }
+    int zeroed = disk.discard(0, FSGeometry::blocks);
+    if (zeroed != 0) {
+        zeroed = zero_blocks();
+    }
+    {
+        std::lock_guard<std::mutex> sguard(sums_lock);
+        checksums = zeroed == 0;
+        if (!checksums) {
+            // the old contents are still there, unknown to the checksums
+            disk.set_checksums(nullptr, 0, 0);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> rguard(ra_lock);
+        streams.clear();
+        hints.clear();
+    }
+    for (unsigned i = 0; i < FSGeometry::blocks; i++) {
+        fat[i] = FAT_FREE;
+    }
+    fat[ROOT_BLOCK] = FAT_EOF;
+    for (unsigned b = 0; b < FSGeometry::fat_blocks; b++) {
+        fat[FAT_BLOCK + b] = FAT_EOF;
+    }
+    for (unsigned b = 0; b < FSGeometry::csum_blocks; b++) {
+        fat[FSGeometry::csum_block + b] = FAT_EOF;
+    }
+    // delayed files vanish with the rest
+    pending.clear();
+    pending_bytes = 0;
+    dedup_index.clear();
+    init_groups();
+
+    // a format also discards any open batch
+    batching = false;
+    deferred.clear();
+
+    store_fat();
+
+    std::memset(root, 0, BLOCK_SIZE);
+    dir.load(reinterpret_cast<dir_entry*>(root));
+    // an empty directory is all zeros, which is what the block reads as
+    if (zeroed != 0) {
+        write_block(ROOT_BLOCK, root);
+    }
+
+    return 0;
+}
+
+int
+FS::zero_blocks()
+{
+    std::vector<uint8_t> zeros((size_t)ZERO_RUN * BLOCK_SIZE, 0);
+    for (unsigned b = 0; b < FSGeometry::blocks; b += ZERO_RUN) {
+        unsigned n = FSGeometry::blocks - b < ZERO_RUN ? FSGeometry::blocks - b : ZERO_RUN;
+        if (disk.write_run(b, n, zeros.data()) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// create <filepath> creates a new file on the disk, the data content is
+// written on the following rows (ended with an empty row)
+int
+FS::create(std::string filepath)
+{
+    OpTimer timer(counters, OP_CREATE);
+    if (verbose)
+        std::cout << "FS::create(" << filepath << ")\n";
+
+    int ret = check_new(filepath);
+    if (ret != 0) {
+        return ret;
+    }
+
+    if (verbose)
+        std::cout << "Enter data. Empty line to end.\n";
+    std::string data;
+    std::string line;
+    while (true) {
+        if (!std::getline(std::cin, line)) {
+            break;
+        }
+        if (line.empty()) {
+            break;
+        }
+        data += line;
+        data += '\n';
+    }
 
+    uint32_t size = static_cast<uint32_t>(data.size());
+    if (recorder) recorder->record(OP_CREATE, filepath, "", size);
+    return store_file(filepath, data.c_str(), size);
+}
+
+// creates a new file with <size> bytes of content taken from <data>
+int
+FS::create(std::string filepath, const char *data, uint32_t size)
+{
+    OpTimer timer(counters, OP_CREATE);
+    if (verbose)
+        std::cout << "FS::create(" << filepath << ")\n";
+    if (recorder) recorder->record(OP_CREATE, filepath, "", size);
+
+    int ret = check_new(filepath);
+    if (ret != 0) {
+        return ret;
+    }
+    return store_file(filepath, data, size);
+}
+
+// cat <filepath> reads the content of a file and prints it on the screen
+int
+FS::cat(std::string filepath)
+{
+    OpTimer timer(counters, OP_CAT);
+    if (verbose)
+        std::cout << "FS::cat(" << filepath << ")\n";
+    if (recorder) recorder->record(OP_CAT, filepath);
+
+    fs_stat st;
+    int ret = stat_file(filepath.c_str(), st);
+    if (ret != 0) {
+        return ret;
+    }
+    if (st.type != TYPE_FILE) {
+        return -3;
+    }
+    if (st.size == 0) {
+        return 0;
+    }
+    std::vector<char> buf(st.size);
+    ret = read_file(filepath.c_str(), buf.data(), st.size, 0);
+    if (ret < 0) {
+        return ret;
+    }
+    std::cout.write(buf.data(), ret);
+    std::cout << '\n';
+    return 0;
+}
+
+// ls lists the content in the currect directory (files and sub-directories)
+int
+FS::ls()
+{
+    OpTimer timer(counters, OP_LS);
+    if (verbose)
+        std::cout << "FS::ls()\n";
+    if (recorder) recorder->record(OP_LS);
+
+    DirView entries(dir_lock, reinterpret_cast<dir_entry*>(root), dir.used);
+    for (const dir_entry &e : entries) {
+        std::cout << e.file_name << " " << e.size << "\n";
+    }
     return 0;
 }
 
-// cat <filepath> reads the content of a file and prints it on the screen
 int
-FS::cat(std::string filepath)
+FS::stat(const char *filepath, fs_stat &st)
 {
-    std::cout << "FS::cat(" << filepath << ")\n";
+    OpTimer timer(counters, OP_STAT);
+    if (recorder) recorder->record(OP_STAT, filepath);
+    return stat_file(filepath, st);
+}
 
-    unsigned char fat_block[BLOCK_SIZE];
-    if (disk.read(FAT_BLOCK, fat_block) == 0) {
-        std::memcpy(fat, fat_block, BLOCK_SIZE);
-    }
+int
+FS::stat_file(const char *filepath, fs_stat &st)
+{
+    std::lock_guard<std::mutex> guard(dir_lock);
+    dir_entry *entries = reinterpret_cast<dir_entry*>(root);
 
-    unsigned char dir_block[BLOCK_SIZE];
-    if (disk.read(ROOT_BLOCK, dir_block) != 0) {
-        return -1;
+    int index = find_entry(entries, filepath, std::strlen(filepath));
+    if (index == -1) {
+        return -2;
     }
-    dir_entry *entries = reinterpret_cast<dir_entry*>(dir_block);
-    int n = BLOCK_SIZE / sizeof(dir_entry);
+    const dir_entry &e = entries[index];
+    st.size = e.size;
+    st.first_blk = e.first_blk;
+    st.type = e.type & TYPE_MASK;
+    st.compressed = (e.type & TYPE_COMPRESSED) != 0;
+    st.access_rights = e.access_rights;
+    st.allocated = chain_length(e.first_blk) * BLOCK_SIZE;
+    return 0;
+}
 
-    int index = -1;
-    for (int i = 0; i < n; i++) {
-        if (entries[i].file_name[0] != '\0' &&
-            filepath == entries[i].file_name) {
-            index = i;
-            break;
-        }
-    }
+// the offset is recorded as the second argument
+int
+FS::read(const char *filepath, char *buf, uint32_t len, uint32_t offset)
+{
+    OpTimer timer(counters, OP_READ);
+    if (recorder) recorder->record(OP_READ, filepath, std::to_string(offset), len);
+    return read_file(filepath, buf, len, offset);
+}
+
+int
+FS::read_file(const char *filepath, char *buf, uint32_t len, uint32_t offset)
+{
+    std::unique_lock<std::mutex> lock(dir_lock);
+    dir_entry *entries = reinterpret_cast<dir_entry*>(root);
+
+    int index = find_entry(entries, filepath, std::strlen(filepath));
     if (index == -1) {
         return -2;
     }
-
-    dir_entry &e = entries[index];
-    if (e.type != TYPE_FILE) {
+    dir_entry e = entries[index];
+    if ((e.type & TYPE_MASK) != TYPE_FILE) {
         return -3;
     }
-    if (e.size == 0) {
+    if (offset >= e.size || len == 0) {
         return 0;
     }
+    uint32_t n = e.size - offset;
+    if (n > len) n = len;
+    // a delayed file is still in memory
+    std::map<int, std::string>::iterator it = pending.find(index);
+    if (it != pending.end()) {
+        std::memcpy(buf, it->second.data() + offset, n);
+        counters.data_read(n);
+        return n;
+    }
+    // the chain cannot change while the file is pinned
+    pin(e.first_blk);
+    lock.unlock();
+
+    int ret = read_data(e, buf, n, offset);
+    unpin(e.first_blk);
+    if (ret != 0) {
+        return ret;
+    }
+    counters.data_read(n);
+    return n;
+}
 
-    uint32_t left = e.size;
-    int block = e.first_blk;
+int
+FS::read_data(const dir_entry &e, char *buf, uint32_t n, uint32_t offset)
+{
+    if (e.type & TYPE_COMPRESSED) {
+        return read_packed(e, buf, n, offset);
+    }
+    ChainCursor c(fat, e.first_blk);
+    for (uint32_t skip = offset / BLOCK_SIZE; skip > 0; skip--) {
+        c.next();
+    }
+    uint32_t pos = offset % BLOCK_SIZE;
+    uint32_t done = 0;
+    uint32_t k = offset / BLOCK_SIZE;
+    bool low = scan_hint(hint_of(e.first_blk));
     unsigned char data_block[BLOCK_SIZE];
 
-    while (block != FAT_EOF && left > 0) {
-        if (disk.read(block, data_block) != 0) {
+    while (done < n) {
+        int block = c.block();
+        uint32_t chunk = BLOCK_SIZE - pos;
+        if (chunk > n - done) chunk = n - done;
+        readahead(e.first_blk, k++, blocks_for(e.size), c);
+        if (block == HOLE_BLOCK) {
+            // holes read as zeros without touching the disk
+            std::memset(buf + done, 0, chunk);
+        } else if (block < (int)FIRST_DATA_BLOCK) {
             return -4;
+        } else if (chunk == BLOCK_SIZE) {
+            // whole blocks go straight to the caller's buffer
+            if (read_block(block, reinterpret_cast<uint8_t*>(buf + done), low) != 0) {
+                return -4;
+            }
+        } else {
+            if (read_block(block, data_block, low) != 0) {
+                return -4;
+            }
+            std::memcpy(buf + done, data_block + pos, chunk);
         }
-        uint32_t to_print = (left > BLOCK_SIZE) ? BLOCK_SIZE : left;
-        std::cout.write(reinterpret_cast<char*>(data_block), to_print);
-        left  -= to_print;
-        block = fat[block];
+        done += chunk;
+        pos = 0;
+        c.next();
     }
-
-    std::cout << std::endl;
     return 0;
-
 }
 
-// ls lists the content in the currect directory (files and sub-directories)
+// Only the blocks holding the chunk table and the chunks that overlap the
+// request are read. A chunk length with CHUNK_RAW set is a chunk that did
+// not compress and is stored as is.
 int
-FS::ls()
+FS::read_packed(const dir_entry &e, char *buf, uint32_t n, uint32_t offset)
 {
-    std::cout << "FS::ls()\n";
-
-    unsigned char dir_block[BLOCK_SIZE];
-    if (disk.read(ROOT_BLOCK, dir_block) != 0) {
-        return -1;
+    std::vector<int> blocks;
+    chain_blocks(e.first_blk, FSGeometry::max_file_size, blocks);
+    unsigned chunks = blocks_for(e.size);
+    std::vector<uint8_t> table(chunks * 2);
+    if (read_stream(blocks, 0, table.size(), table.data()) != 0) {
+        return -4;
+    }
+    unsigned k0 = offset / BLOCK_SIZE, k1 = (offset + n - 1) / BLOCK_SIZE;
+    uint32_t start = table.size(), end;
+    for (unsigned k = 0; k < k0; k++) {
+        start += (table[2 * k] | (table[2 * k + 1] << 8)) & ~CHUNK_RAW;
+    }
+    end = start;
+    for (unsigned k = k0; k <= k1; k++) {
+        end += (table[2 * k] | (table[2 * k + 1] << 8)) & ~CHUNK_RAW;
+    }
+    std::vector<uint8_t> packed(end - start);
+    // the chunks are needed all at once, they are read as runs
+    if (end > start) {
+        unsigned b0 = start / BLOCK_SIZE, b1 = (end - 1) / BLOCK_SIZE + 1;
+        if (b1 > blocks.size()) b1 = blocks.size();
+        if (b0 + 1 < b1) {
+            cache.prefetch(std::vector<int>(blocks.begin() + b0, blocks.begin() + b1));
+        }
+    }
+    if (read_stream(blocks, start, packed.size(), packed.data()) != 0) {
+        return -4;
     }
 
-    dir_entry *entries = reinterpret_cast<dir_entry*>(dir_block);
-    int n = BLOCK_SIZE / sizeof(dir_entry);
-
-    for (int i = 0; i < n; i++) {
-        if (entries[i].file_name[0] != '\0') {
-            std::cout << entries[i].file_name
-                      << " "
-                      << entries[i].size
-                      << "\n";
+    uint8_t plain[BLOCK_SIZE];
+    uint32_t p = 0, done = 0;
+    for (unsigned k = k0; k <= k1; k++) {
+        unsigned v = table[2 * k] | (table[2 * k + 1] << 8);
+        unsigned len = v & ~CHUNK_RAW;
+        uint32_t want = e.size - k * BLOCK_SIZE;
+        if (want > BLOCK_SIZE) want = BLOCK_SIZE;
+        if (v & CHUNK_RAW) {
+            if (len != want) return -4;
+            std::memcpy(plain, packed.data() + p, len);
+        } else if (lz_decompress(packed.data() + p, len, plain, BLOCK_SIZE) != (int)want) {
+            return -4;
         }
+        p += len;
+        uint32_t from = (k == k0) ? offset % BLOCK_SIZE : 0;
+        uint32_t cnt = want - from;
+        if (cnt > n - done) cnt = n - done;
+        std::memcpy(buf + done, plain + from, cnt);
+        done += cnt;
     }
+    return 0;
+}
 
+int
+FS::read_stream(const std::vector<int> &blocks, uint32_t pos, uint32_t len, uint8_t *out)
+{
+    unsigned char data_block[BLOCK_SIZE];
+    while (len > 0) {
+        unsigned k = pos / BLOCK_SIZE;
+        uint32_t at = pos % BLOCK_SIZE;
+        uint32_t chunk = BLOCK_SIZE - at;
+        if (chunk > len) chunk = len;
+        if (k >= blocks.size()) {
+            return -4;
+        }
+        if (blocks[k] == HOLE_BLOCK) {
+            std::memset(out, 0, chunk);
+        } else if (read_block(blocks[k], data_block) != 0) {
+            return -4;
+        } else {
+            std::memcpy(out, data_block + at, chunk);
+        }
+        out += chunk;
+        pos += chunk;
+        len -= chunk;
+    }
     return 0;
 }
 
+DirView
+FS::readdir()
+{
+    // times the wait for the directory, not the caller's walk over it
+    OpTimer timer(counters, OP_READDIR);
+    if (recorder) recorder->record(OP_READDIR);
+    return DirView(dir_lock, reinterpret_cast<dir_entry*>(root), dir.used);
+}
+
 // cp <sourcepath> <destpath> makes an exact copy of the file
 // <sourcepath> to a new file <destpath>
 int
 FS::cp(std::string sourcepath, std::string destpath)
 {
-    std::cout << "FS::cp(" << sourcepath << "," << destpath << ")\n";
-
-    unsigned char fat_block[BLOCK_SIZE];
-    if (disk.read(FAT_BLOCK, fat_block) == 0) {
-        std::memcpy(fat, fat_block, BLOCK_SIZE);
-    }
+    OpTimer timer(counters, OP_CP);
+    if (verbose)
+        std::cout << "FS::cp(" << sourcepath << "," << destpath << ")\n";
+    if (recorder) recorder->record(OP_CP, sourcepath, destpath);
 
-    unsigned char dir_block[BLOCK_SIZE];
-    if (disk.read(ROOT_BLOCK, dir_block) != 0) {
-        return -1;
-    }
+    std::unique_lock<std::mutex> lock(dir_lock);
 
-    dir_entry *entries = reinterpret_cast<dir_entry*>(dir_block);
-    int n = BLOCK_SIZE / sizeof(dir_entry);
+    dir_entry *entries = reinterpret_cast<dir_entry*>(root);
 
-    int src_i = -1;
-    for (int i = 0; i < n; i++) {
-        if (entries[i].file_name[0] != '\0' && sourcepath == entries[i].file_name) {
-            src_i = i;
-            break;
-        }
-    }
+    int src_i = find_entry(entries, sourcepath);
     if (src_i == -1) return -2;
-
-    for (int i = 0; i < n; i++) {
-        if (entries[i].file_name[0] != '\0' && destpath == entries[i].file_name) {
-            return -3;
-        }
-    }
-
-    int free_i = -1;
-    for (int i = 0; i < n; i++) {
-        if (entries[i].file_name[0] == '\0') {
-            free_i = i;
-            break;
-        }
+    if (find_entry(entries, destpath) != -1) return -3;
+    if (free_entry() == -1) return -4;
+    flush_pending(src_i);
+
+    if (dedup && entries[src_i].first_blk != 0) {
+        // the copy shares the chain of the source
+        const dir_entry &e = entries[src_i];
+        link_entry(free_entry(), destpath, e.size, e.first_blk, e.access_rights, e.type);
+        counters.data_deduped(e.size);
+        store_dir();
+        return 0;
     }
-    if (free_i == -1) return -4;
 
-    dir_entry &src = entries[src_i];
+    // the source is pinned so the copy can run without holding dir_lock
+    dir_entry src = entries[src_i];
+    pin(src.first_blk);
+    lock.unlock();
 
-    uint32_t left = src.size;
-    int blk = src.first_blk;
+    // a compressed file is copied as stored, its whole chain
+    std::vector<int> blocks;
+    chain_blocks(src.first_blk, (src.type & TYPE_COMPRESSED) ? FSGeometry::max_file_size : src.size,
+                 blocks);
 
+    // a reader thread is only worth starting for more than a couple of blocks
+    ChainReader reader(cache, &counters, blocks, pipelined && blocks.size() > 2);
     uint16_t new_first = 0;
     int prev = -1;
+    unsigned holes = 0;
+    int ret = 0;
 
-    while (blk != FAT_EOF && left > 0) {
-        int nb = -1;
-        for (int i = 2; i < BLOCK_SIZE / 2; i++) {
-            if (fat[i] == FAT_FREE) {
-                nb = i;
-                break;
-            }
+    for (size_t k = 0; k < blocks.size(); k++) {
+        const uint8_t *data_block = reader.next();
+        if (data_block == nullptr) {
+            ret = -6;
+            break;
+        }
+        if (blocks[k] == HOLE_BLOCK) {
+            // the copy keeps the holes of the source
+            reader.release();
+            holes++;
+            continue;
+        }
+        int nb = alloc_block(prev);
+        if (nb == -1) {
+            ret = -5;
+            break;
         }
-        if (nb == -1) return -5;
-
-        unsigned char data_block[BLOCK_SIZE];
-        disk.read(blk, data_block);
-        disk.write(nb, data_block);
 
+        // linked first, so a failed write frees it with the rest
         if (new_first == 0) new_first = nb;
-        if (prev != -1) fat[prev] = nb;
-
+        if (prev != -1) set_fat(prev, MAKE_LINK(nb, holes));
+        holes = 0;
         prev = nb;
-        blk = fat[blk];
-        left -= BLOCK_SIZE;
-    }
-
-    fat[prev] = FAT_EOF;
 
-    std::memcpy(fat_block, fat, BLOCK_SIZE);
-    disk.write(FAT_BLOCK, fat_block);
-
-    dir_entry &d = entries[free_i];
-    std::memset(&d, 0, sizeof(dir_entry));
-    std::strncpy(d.file_name, destpath.c_str(), sizeof(d.file_name)-1);
-    d.size = src.size;
-    d.first_blk = new_first;
-    d.type = TYPE_FILE;
-    d.access_rights = src.access_rights;
-
-    disk.write(ROOT_BLOCK, dir_block);
+        int err = write_block(nb, const_cast<uint8_t*>(data_block));
+        reader.release();
+        if (err != 0) {
+            ret = -6;
+            break;
+        }
+    }
+    unpin(src.first_blk);
+    if (ret != 0) {
+        free_chain(new_first);
+        return ret;
+    }
 
-    return 0;
+    counters.data_read(src.size);
+    counters.data_written(src.size);
+    return add_entry(destpath, src.size, new_first, src.access_rights, src.type);
 }
 
 // mv <sourcepath> <destpath> renames the file <sourcepath> to the name <destpath>,
@@ -332,36 +1706,25 @@ FS::cp(std::string sourcepath, std::string destpath)
 int
 FS::mv(std::string sourcepath, std::string destpath)
 {
-    std::cout << "FS::mv(" << sourcepath << "," << destpath << ")\n";
+    OpTimer timer(counters, OP_MV);
+    if (verbose)
+        std::cout << "FS::mv(" << sourcepath << "," << destpath << ")\n";
+    if (recorder) recorder->record(OP_MV, sourcepath, destpath);
 
-    unsigned char dir_block[BLOCK_SIZE];
-    if (disk.read(ROOT_BLOCK, dir_block) != 0) {
-        return -1;
-    }
+    std::lock_guard<std::mutex> guard(dir_lock);
 
-    dir_entry *entries = reinterpret_cast<dir_entry*>(dir_block);
-    int n = BLOCK_SIZE / sizeof(dir_entry);
+    dir_entry *entries = reinterpret_cast<dir_entry*>(root);
 
-    int src_i = -1;
-    for (int i = 0; i < n; i++) {
-        if (entries[i].file_name[0] != '\0' && sourcepath == entries[i].file_name) {
-            src_i = i;
-            break;
-        }
-    }
+    int src_i = find_entry(entries, sourcepath);
     if (src_i == -1) return -2;
-
-    for (int i = 0; i < n; i++) {
-        if (entries[i].file_name[0] != '\0' && destpath == entries[i].file_name) {
-            return -3;
-        }
-    }
+    if (find_entry(entries, destpath) != -1) return -3;
 
     dir_entry &e = entries[src_i];
     std::memset(e.file_name, 0, sizeof(e.file_name));
     std::strncpy(e.file_name, destpath.c_str(), sizeof(e.file_name)-1);
+    dir.update(entries, src_i);
 
-    disk.write(ROOT_BLOCK, dir_block);
+    store_dir();
 
     return 0;
 }
@@ -370,44 +1733,38 @@ FS::mv(std::string sourcepath, std::string destpath)
 int
 FS::rm(std::string filepath)
 {
-    std::cout << "FS::rm(" << filepath << ")\n";
-
-    unsigned char fat_block[BLOCK_SIZE];
-    disk.read(FAT_BLOCK, fat_block);
-    std::memcpy(fat, fat_block, BLOCK_SIZE);
-
-    unsigned char dir_block[BLOCK_SIZE];
-    if (disk.read(ROOT_BLOCK, dir_block) != 0) {
-        return -1;
-    }
-
-    dir_entry *entries = reinterpret_cast<dir_entry*>(dir_block);
-    int n = BLOCK_SIZE / sizeof(dir_entry);
-
-    int i = -1;
-    for (int k = 0; k < n; k++) {
-        if (entries[k].file_name[0] != '\0' &&
-            filepath == entries[k].file_name) {
-            i = k;
-            break;
-        }
+    OpTimer timer(counters, OP_RM);
+    if (verbose)
+        std::cout << "FS::rm(" << filepath << ")\n";
+    if (recorder) recorder->record(OP_RM, filepath);
+
+    std::unique_lock<std::mutex> lock(dir_lock);
+    dir_entry *entries = reinterpret_cast<dir_entry*>(root);
+    int i;
+    while (true) {
+        i = find_entry(entries, filepath);
+        if (i == -1) return -2;
+        // wait for readers of the blocks we are about to free
+        if (!pinned(entries[i].first_blk)) break;
+        unpinned.wait(lock);
     }
-    if (i == -1) return -2;
 
     dir_entry &e = entries[i];
-
-    int blk = e.first_blk;
-    while (blk != FAT_EOF && blk >= 0) {
-        int next = fat[blk];
-        fat[blk] = FAT_FREE;
-        blk = next;
+    std::map<int, std::string>::iterator it = pending.find(i);
+    if (it != pending.end()) {
+        // never written, only the reservation is returned
+        unreserve(reserve_for(e.size, e.type));
+        pending_bytes -= e.size;
+        pending.erase(it);
     }
-
+    uint16_t first_blk = e.first_blk;
     std::memset(&e, 0, sizeof(dir_entry));
+    dir.update(entries, i);
+    // other entries may still share the chain
+    release_chain(first_blk);
 
-    std::memcpy(fat_block, fat, BLOCK_SIZE);
-    disk.write(FAT_BLOCK, fat_block);
-    disk.write(ROOT_BLOCK, dir_block);
+    store_fat();
+    store_dir();
 
     return 0;
 }
@@ -417,84 +1774,512 @@ FS::rm(std::string filepath)
 int
 FS::append(std::string filepath1, std::string filepath2)
 {
-    std::cout << "FS::append(" << filepath1 << "," << filepath2 << ")\n";
+    OpTimer timer(counters, OP_APPEND);
+    if (verbose)
+        std::cout << "FS::append(" << filepath1 << "," << filepath2 << ")\n";
+    if (recorder) recorder->record(OP_APPEND, filepath1, filepath2);
+
+    std::unique_lock<std::mutex> lock(dir_lock);
+    dir_entry *entries = reinterpret_cast<dir_entry*>(root);
+    int i1, i2;
+    while (true) {
+        i1 = find_entry(entries, filepath1);
+        i2 = find_entry(entries, filepath2);
+        if (i1 == -1 || i2 == -1) return -2;
+        flush_pending(i1);
+        flush_pending(i2);
+        // the tail of <filepath2> changes, wait for anyone reading it
+        if (!pinned(entries[i2].first_blk)) break;
+        unpinned.wait(lock);
+    }
 
-    unsigned char fat_block[BLOCK_SIZE];
-    disk.read(FAT_BLOCK, fat_block);
-    std::memcpy(fat, fat_block, BLOCK_SIZE);
+    if ((entries[i1].type | entries[i2].type) & TYPE_COMPRESSED) {
+        return append_packed(i1, i2);
+    }
+    // the tail of a shared chain is not ours to extend
+    int ret = unshare(i2);
+    if (ret != 0) {
+        return ret;
+    }
+
+    dir_entry &A = entries[i1];
+    dir_entry &B = entries[i2];
 
-    unsigned char dir_block[BLOCK_SIZE];
-    if (disk.read(ROOT_BLOCK, dir_block) != 0) return -1;
+    std::vector<int> src_blocks, dst_blocks;
+    chain_blocks(A.first_blk, A.size, src_blocks);
+    chain_blocks(B.first_blk, B.size, dst_blocks);
+
+    // the new data continues in the partly filled last block of <filepath2>
+    int end = dst_blocks.empty() ? -1 : dst_blocks.back();
+    uint32_t fill = B.size % BLOCK_SIZE;
+    int cur = -1;
+    unsigned char out[BLOCK_SIZE];
+    if (fill != 0) {
+        cur = end;
+        if (read_block(cur, out) != 0) return -5;
+    }
 
-    dir_entry *entries = reinterpret_cast<dir_entry*>(dir_block);
-    int n = BLOCK_SIZE / sizeof(dir_entry);
+    ChainReader reader(cache, &counters, src_blocks, pipelined && src_blocks.size() > 2);
+    uint32_t left = A.size;
+    int first_new = -1;
+    int new_after = -1; // last block of <filepath2> before the new ones
+    ret = 0;
+
+    for (size_t k = 0; k < src_blocks.size() && ret == 0; k++) {
+        const uint8_t *buf = reader.next();
+        if (buf == nullptr) {
+            ret = -5;
+            break;
+        }
+        uint32_t len = (left > BLOCK_SIZE) ? BLOCK_SIZE : left;
+        uint32_t off = 0;
+        while (off < len) {
+            if (cur == -1) {
+                // blocks reserved by fallocate are used before new ones
+                int nb = (end == -1) ? B.first_blk : LINK_BLOCK(fat[end]);
+                if (nb < (int)FIRST_DATA_BLOCK) {
+                    nb = alloc_block(end);
+                    if (nb == -1) {
+                        ret = -4;
+                        break;
+                    }
+                    if (first_new == -1) {
+                        first_new = nb;
+                        new_after = end;
+                    }
+                    if (end != -1) set_fat(end, nb);
+                }
+                end = cur = nb;
+                fill = 0;
+                if (len - off == BLOCK_SIZE) {
+                    // block aligned, write the source buffer as is
+                    write_block(cur, const_cast<uint8_t*>(buf));
+                    cur = -1;
+                    break;
+                }
+                std::memset(out, 0, BLOCK_SIZE);
+            }
+            uint32_t n = BLOCK_SIZE - fill;
+            if (n > len - off) n = len - off;
+            std::memcpy(out + fill, buf + off, n);
+            fill += n;
+            off  += n;
+            if (fill == BLOCK_SIZE) {
+                write_block(cur, out);
+                cur = -1;
+            }
+        }
+        reader.release();
+        left -= len;
+    }
 
-    int i1 = -1, i2 = -1;
-    for (int i = 0; i < n; i++) {
-        if (entries[i].file_name[0] != '\0' && filepath1 == entries[i].file_name)
-            i1 = i;
-        if (entries[i].file_name[0] != '\0' && filepath2 == entries[i].file_name)
-            i2 = i;
+    if (ret != 0) {
+        // unlink and free whatever was added to the chain
+        if (first_new != -1) {
+            if (new_after != -1) set_fat(new_after, FAT_EOF);
+            free_chain(first_new);
+        }
+        return ret;
+    }
+    if (cur != -1) {
+        write_block(cur, out);
     }
-    if (i1 == -1 || i2 == -1) return -2;
+    if (B.first_blk == 0 && first_new != -1) {
+        B.first_blk = first_new;
+    }
+    B.size += A.size;
+    dir.update(entries, i2);
+    counters.data_read(A.size);
+    counters.data_written(A.size);
+
+    store_fat();
+    store_dir();
+
+    return 0;
+}
 
+// appends to or from a compressed file by rewriting <filepath2> whole,
+// compressed again if it was. dir_lock held.
+int
+FS::append_packed(int i1, int i2)
+{
+    dir_entry *entries = reinterpret_cast<dir_entry*>(root);
     dir_entry &A = entries[i1];
     dir_entry &B = entries[i2];
 
-    int end = B.first_blk;
-    if (end != 0) {
-        while (fat[end] != FAT_EOF) {
-            end = fat[end];
+    std::vector<char> data((size_t)B.size + A.size);
+    if (B.size > 0 && read_data(B, data.data(), B.size, 0) != 0) return -5;
+    if (A.size > 0 && read_data(A, data.data() + B.size, A.size, 0) != 0) return -5;
+    if (data.size() > FSGeometry::max_file_size) return -4;
+
+    uint16_t first_blk;
+    if (store_chain(data.data(), data.size(), B.type, first_blk) != 0) {
+        return -4;
+    }
+    counters.data_read(A.size);
+    uint16_t old = B.first_blk;
+    B.first_blk = first_blk;
+    B.size = data.size();
+    dir.update(entries, i2);
+    release_chain(old);
+
+    store_fat();
+    store_dir();
+
+    return 0;
+}
+
+// fallocate <filepath> <size> reserves blocks for <size> bytes of
+// <filepath> without changing its size
+int
+FS::fallocate(std::string filepath, uint32_t size)
+{
+    OpTimer timer(counters, OP_FALLOCATE);
+    if (verbose)
+        std::cout << "FS::fallocate(" << filepath << "," << size << ")\n";
+    if (recorder) recorder->record(OP_FALLOCATE, filepath, "", size);
+
+    if (filepath.find('/') != std::string::npos) {
+        return -1;
+    }
+    unsigned want = blocks_for(size);
+    std::unique_lock<std::mutex> lock(dir_lock);
+    dir_entry *entries = reinterpret_cast<dir_entry*>(root);
+    int i;
+    while (true) {
+        i = find_entry(entries, filepath);
+        if (i == -1) break;
+        flush_pending(i);
+        // the tail of the chain changes, wait for anyone reading it
+        if (!pinned(entries[i].first_blk)) break;
+        unpinned.wait(lock);
+    }
+
+    if (i == -1) {
+        // a new empty file that owns the extent
+        lock.unlock();
+        int ret = check_new(filepath);
+        if (ret != 0) {
+            return ret;
+        }
+        int first;
+        ret = extend_chain(-1, want, first);
+        if (ret != 0) {
+            return ret;
+        }
+        return add_entry(filepath, 0, first == -1 ? 0 : first, READ | WRITE);
+    }
+
+    dir_entry &e = entries[i];
+    if ((e.type & TYPE_MASK) != TYPE_FILE) {
+        return -3;
+    }
+    // compressed files are rewritten on append, they keep no reserve
+    if (e.type & TYPE_COMPRESSED) {
+        return -6;
+    }
+    int ret = unshare(i);
+    if (ret != 0) {
+        return ret;
+    }
+    int tail = -1;
+    unsigned have = 0;
+    // holes count towards the blocks the file already covers
+    for (int b = e.first_blk; b >= (int)FIRST_DATA_BLOCK; b = LINK_BLOCK(fat[b])) {
+        tail = b;
+        have += 1 + LINK_HOLES(fat[b]);
+    }
+    if (want <= have) {
+        return 0;
+    }
+    int first;
+    ret = extend_chain(tail, want - have, first);
+    if (ret != 0) {
+        return ret;
+    }
+    if (e.first_blk == 0) {
+        e.first_blk = first;
+        dir.update(entries, i);
+        store_dir();
+    }
+    store_fat();
+    return 0;
+}
+
+// advise <filepath> <hint> records how <filepath> will be read; willneed
+// and dontneed also fill or empty the cache right away
+int
+FS::advise(std::string filepath, int hint)
+{
+    OpTimer timer(counters, OP_ADVISE);
+    if (hint < 0 || hint >= ADV_COUNT) {
+        return -1;
+    }
+    if (verbose)
+        std::cout << "FS::advise(" << filepath << "," << advice_names[hint] << ")\n";
+    if (recorder) recorder->record(OP_ADVISE, filepath, advice_names[hint]);
+
+    std::unique_lock<std::mutex> lock(dir_lock);
+    dir_entry *entries = reinterpret_cast<dir_entry*>(root);
+    int i = find_entry(entries, filepath);
+    if (i == -1) {
+        return -2;
+    }
+    // hints are kept by first block, a delayed file gets its blocks now
+    flush_pending(i);
+    dir_entry e = entries[i];
+    if ((e.type & TYPE_MASK) != TYPE_FILE) {
+        return -3;
+    }
+    if (e.first_blk == 0) {
+        return 0;
+    }
+    {
+        std::lock_guard<std::mutex> guard(ra_lock);
+        if (hint == ADV_NORMAL) {
+            hints.erase(e.first_blk);
+        } else {
+            hints[e.first_blk] = hint;
+        }
+        streams.erase(e.first_blk);
+    }
+    if (hint != ADV_WILLNEED && hint != ADV_DONTNEED) {
+        return 0;
+    }
+
+    pin(e.first_blk);
+    lock.unlock();
+    std::vector<int> blocks;
+    chain_blocks(e.first_blk,
+                 (e.type & TYPE_COMPRESSED) ? FSGeometry::max_file_size : e.size, blocks);
+    if (hint == ADV_WILLNEED) {
+        // the start of the file if it does not fit
+        if (blocks.size() > cache.capacity()) {
+            blocks.resize(cache.capacity());
         }
+        cache.prefetch(blocks);
     } else {
-        int nb = -1;
-        for (int j = 2; j < BLOCK_SIZE / 2; j++) {
-            if (fat[j] == FAT_FREE) { nb = j; break; }
+        // the file's dirty blocks reach the disk before they are dropped
+        cache.writeback_blocks(blocks);
+        for (size_t k = 0; k < blocks.size(); k++) {
+            if (blocks[k] >= 0) {
+                cache.invalidate(blocks[k]);
+            }
         }
-        if (nb == -1) return -3;
-        B.first_blk = nb;
-        fat[nb] = FAT_EOF;
-        end = nb;
     }
+    unpin(e.first_blk);
+    return 0;
+}
 
-    uint32_t left = A.size;
-    int blk = A.first_blk;
-    unsigned char buf[BLOCK_SIZE];
+int
+FS::scrub(unsigned threads, std::vector<int> &bad)
+{
+    if (verbose)
+        std::cout << "FS::scrub(" << threads << ")\n";
+    bad.clear();
+    {
+        std::lock_guard<std::mutex> guard(sums_lock);
+        if (!checksums) {
+            return -1;
+        }
+    }
+    // the disk is checked, not the cache
+    cache.writeback(true);
+    // the root directory, the FAT and every block some chain holds
+    std::vector<int> blocks;
+    for (unsigned b = 0; b < FSGeometry::csum_block; b++) {
+        blocks.push_back(b);
+    }
+    for (int g = 0; g < ALLOC_GROUPS; g++) {
+        std::lock_guard<std::mutex> guard(groups[g].lock);
+        for (unsigned b = groups[g].first; b < groups[g].last; b++) {
+            if (fat[b] != FAT_FREE) {
+                blocks.push_back(b);
+            }
+        }
+    }
 
-    while (blk != FAT_EOF && left > 0) {
-        disk.read(blk, buf);
+    // the region has no checksums of its own, its CRC covers it
+    {
+        uint32_t region[sizeof(sums_stored) / sizeof(uint32_t)];
+        uint8_t *p = reinterpret_cast<uint8_t*>(region);
+        bool ok = true;
+        for (unsigned b = 0; b < FSGeometry::csum_blocks && ok; b++) {
+            ok = read_block(FSGeometry::csum_block + b, p + b * BLOCK_SIZE) == 0;
+        }
+        std::lock_guard<std::mutex> guard(sums_lock);
+        if (!ok || !region_valid(region)) {
+            for (unsigned b = 0; b < FSGeometry::csum_blocks; b++) {
+                bad.push_back(FSGeometry::csum_block + b);
+            }
+        }
+    }
 
-        int nb = -1;
-        for (int j = 2; j < BLOCK_SIZE / 2; j++) {
-            if (fat[j] == FAT_FREE) { nb = j; break; }
+    if (threads == 0) {
+        threads = 1;
+    }
+    std::vector<std::vector<int> > failed(threads);
+    std::vector<std::thread> workers;
+    size_t per = (blocks.size() + threads - 1) / threads;
+    for (unsigned t = 0; t < threads; t++) {
+        size_t from = t * per, to = std::min(blocks.size(), from + per);
+        workers.push_back(std::thread([this, &blocks, &failed, t, from, to] {
+            uint8_t buf[BLOCK_SIZE];
+            for (size_t k = from; k < to; k++) {
+                // the disk itself, not the block cache
+                counters.read(class_of(blocks[k]));
+                if (disk.read(blocks[k], buf) != 0) {
+                    failed[t].push_back(blocks[k]);
+                }
+            }
+        }));
+    }
+    for (size_t t = 0; t < workers.size(); t++) {
+        workers[t].join();
+    }
+    // a block read while it was being written may not match the checksum
+    // yet, so a failed block only counts if it fails again
+    uint8_t buf[BLOCK_SIZE];
+    for (size_t t = 0; t < failed.size(); t++) {
+        for (size_t k = 0; k < failed[t].size(); k++) {
+            counters.read(class_of(failed[t][k]));
+            if (disk.read(failed[t][k], buf) != 0) {
+                bad.push_back(failed[t][k]);
+            }
         }
-        if (nb == -1) return -4;
+    }
+    std::sort(bad.begin(), bad.end());
+    return blocks.size() + FSGeometry::csum_blocks;
+}
 
-        disk.write(nb, buf);
+int
+FS::scrub_start(unsigned threads)
+{
+    {
+        std::lock_guard<std::mutex> guard(sums_lock);
+        if (!checksums) {
+            return -1;
+        }
+    }
+    std::lock_guard<std::mutex> guard(scrub_lock);
+    if (scrub_running) {
+        return -2;
+    }
+    if (scrubber.joinable()) {
+        scrubber.join();
+    }
+    scrub_running = true;
+    scrubber = std::thread(&FS::scrub_run, this, threads);
+    return 0;
+}
 
-        fat[end] = nb;
-        end = nb;
-        fat[end] = FAT_EOF;
+// background thread of scrub_start
+void
+FS::scrub_run(unsigned threads)
+{
+    std::vector<int> bad;
+    int ret = scrub(threads, bad);
+    std::lock_guard<std::mutex> guard(scrub_lock);
+    scrub_ret = ret;
+    scrub_bad.swap(bad);
+    scrub_running = false;
+}
 
-        left -= BLOCK_SIZE;
-        blk = fat[blk];
+int
+FS::scrub_status(std::vector<int> &bad)
+{
+    std::lock_guard<std::mutex> guard(scrub_lock);
+    if (scrub_running) {
+        return 1;
     }
+    bad = scrub_bad;
+    return scrub_ret;
+}
 
-    B.size += A.size;
+// fills <s> with the current I/O and latency counters
+void
+FS::stats(fs_stats &s)
+{
+    counters.snapshot(s);
+    s.verified = disk.blocks_verified();
+    s.checksum_errors = disk.checksum_errors();
+}
 
-    std::memcpy(fat_block, fat, BLOCK_SIZE);
-    disk.write(FAT_BLOCK, fat_block);
-    disk.write(ROOT_BLOCK, dir_block);
+void
+FS::reset_stats()
+{
+    counters.reset();
+    disk.reset_counters();
+}
+
+// begin starts a batch, FAT and directory updates are kept in memory
+// until the batch is committed
+int
+FS::begin()
+{
+    OpTimer timer(counters, OP_BEGIN);
+    if (verbose)
+        std::cout << "FS::begin()\n";
+    if (recorder) recorder->record(OP_BEGIN);
 
+    std::lock_guard<std::mutex> guard(dir_lock);
+    if (batching) {
+        return -1;
+    }
+    batching = true;
     return 0;
 }
 
+// commit writes the metadata changed in the current batch. The FAT goes
+// first so a crash in between can only leak blocks; blocks released by rm
+// are freed after the directory no longer references them.
+int
+FS::commit()
+{
+    OpTimer timer(counters, OP_COMMIT);
+    if (verbose)
+        std::cout << "FS::commit()\n";
+    if (recorder) recorder->record(OP_COMMIT);
+
+    std::lock_guard<std::mutex> guard(dir_lock);
+    if (!batching) {
+        return -1;
+    }
+    batching = false;
+    // delayed files get their blocks with the rest of the batch
+    int ret = 0;
+    while (!pending.empty() && ret == 0) {
+        ret = place_pending(pending.begin()->first);
+        fat_dirty = dir_dirty = true;
+    }
+    if (fat_dirty) {
+        store_fat();
+    }
+    if (dir_dirty) {
+        store_dir();
+    }
+    if (!deferred.empty()) {
+        for (size_t i = 0; i < deferred.size(); i++) {
+            if (dir.refs(deferred[i]) == 0) {
+                free_chain(deferred[i]);
+            }
+        }
+        deferred.clear();
+        store_fat();
+    }
+    fat_dirty = dir_dirty = false;
+    return ret;
+}
+
 // mkdir <dirpath> creates a new sub-directory with the name <dirpath>
 // in the current directory
 int
 FS::mkdir(std::string dirpath)
 {
-    std::cout << "FS::mkdir(" << dirpath << ")\n";
+    OpTimer timer(counters, OP_MKDIR);
+    if (verbose)
+        std::cout << "FS::mkdir(" << dirpath << ")\n";
+    if (recorder) recorder->record(OP_MKDIR, dirpath);
     return 0;
 }
 
@@ -502,7 +2287,10 @@ FS::mkdir(std::string dirpath)
 int
 FS::cd(std::string dirpath)
 {
-    std::cout << "FS::cd(" << dirpath << ")\n";
+    OpTimer timer(counters, OP_CD);
+    if (verbose)
+        std::cout << "FS::cd(" << dirpath << ")\n";
+    if (recorder) recorder->record(OP_CD, dirpath);
     return 0;
 }
 
@@ -511,7 +2299,10 @@ FS::cd(std::string dirpath)
 int
 FS::pwd()
 {
-    std::cout << "FS::pwd()\n";
+    OpTimer timer(counters, OP_PWD);
+    if (verbose)
+        std::cout << "FS::pwd()\n";
+    if (recorder) recorder->record(OP_PWD);
     return 0;
 }
 
@@ -520,6 +2311,9 @@ FS::pwd()
 int
 FS::chmod(std::string accessrights, std::string filepath)
 {
-    std::cout << "FS::chmod(" << accessrights << "," << filepath << ")\n";
+    OpTimer timer(counters, OP_CHMOD);
+    if (verbose)
+        std::cout << "FS::chmod(" << accessrights << "," << filepath << ")\n";
+    if (recorder) recorder->record(OP_CHMOD, accessrights, filepath);
     return 0;
 }
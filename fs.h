@@ -1,6 +1,17 @@
 #include <iostream>
 #include <cstdint>
+#include <string>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <atomic>
+#include <thread>
 #include "disk.h"
+#include "cache.h"
+#include "stats.h"
+#include "geometry.h"
+#include "dirmirror.h"
 
 #ifndef __FS_H__
 #define __FS_H__
@@ -9,13 +20,28 @@
 #define FAT_BLOCK 1
 #define FAT_FREE 0
 #define FAT_EOF -1
+// the checksum region holds this in the entry of its own first block and
+// the CRC of the region in the entry of the second one
+#define CSUM_MAGIC 0x43534d31
+
+// freed blocks wait this long so a burst of rm calls is punched in one go
+#define DISCARD_DELAY_MS 20
+// blocks of zeros written per call where format cannot punch the image
+#define ZERO_RUN 64
 
 #define TYPE_FILE 0
 #define TYPE_DIR 1
+// the low bits of dir_entry.type are the type, the high ones flags
+#define TYPE_MASK 0x0f
+// the file is stored as LZ compressed chunks, see FS::read_packed
+#define TYPE_COMPRESSED 0x80
+// set in a chunk length of a compressed file for a chunk stored as is
+#define CHUNK_RAW 0x8000
 #define READ 0x04
 #define WRITE 0x02
 #define EXECUTE 0x01
 
+
 struct dir_entry {
     char file_name[56]; // name of the file / sub-directory
     uint32_t size; // size of the file in bytes
@@ -24,25 +50,349 @@ struct dir_entry {
     uint8_t access_rights; // read (0x04), write (0x02), execute (0x01)
 };
 
+// Layout of the volume on the disk: one FAT block of 16-bit entries. It is
+// the only layout: FS, Disk and the block cache are written for it, and
+// the geometry is not chosen at run time.
+typedef Geometry<BLOCK_SIZE, int16_t, BLOCK_SIZE / 2, dir_entry> FSGeometry;
+static_assert(FSGeometry::blocks == DISK_BLOCKS, "the layout must cover the disk image");
+
+#define FIRST_DATA_BLOCK FSGeometry::first_data_block
+
+// Sparse files: a link in the FAT may skip up to FSGeometry::max_holes
+// blocks of zeros that have no block on the disk. The first and the last
+// block of a file are always allocated.
+#define LINK_BLOCK(v) ((v) < 0 ? (int)(v) : (int)((v) & ((1 << FSGeometry::link_bits) - 1)))
+#define LINK_HOLES(v) ((v) < 0 ? 0u : (unsigned)(v) >> FSGeometry::link_bits)
+#define MAKE_LINK(blk, holes) ((blk) | ((holes) << FSGeometry::link_bits))
+// what a chain walk returns for a block of a hole
+#define HOLE_BLOCK -2
+
+// walks a chain one logical block at a time, holes included
+class ChainCursor {
+public:
+    ChainCursor(const FSGeometry::fat_entry *fat, int first)
+        : fat(fat), cur(first), holes(0) {}
+    // the block at the current position: HOLE_BLOCK in a hole, below
+    // FIRST_DATA_BLOCK past the end of the chain
+    int block() const { return holes > 0 ? HOLE_BLOCK : cur; }
+    void next()
+    {
+        if (holes > 0) {
+            holes--;
+        } else if (cur >= (int)FIRST_DATA_BLOCK) {
+            int v = fat[cur];
+            cur = LINK_BLOCK(v);
+            holes = LINK_HOLES(v);
+        }
+    }
+private:
+    const FSGeometry::fat_entry *fat;
+    int cur; // next allocated block
+    unsigned holes; // hole blocks before <cur>
+};
+
+// the data blocks are split into allocation groups, each with its own
+// free count and lock, so concurrent writers do not contend on one scan
+#define ALLOC_GROUPS 8
+#define GROUP_SIZE ((FSGeometry::data_blocks + ALLOC_GROUPS - 1) / ALLOC_GROUPS)
+
+// Readahead: a read of the block after the one read last continues a
+// stream. Its window starts at RA_MIN blocks and doubles up to RA_MAX each
+// time the reader gets within half a window of what was read ahead.
+#define RA_MIN 4
+#define RA_MAX 64
+// streams remembered before the oldest ones are forgotten
+#define RA_STREAMS 32
+
+// access pattern hints for FS::advise
+enum fs_advice {
+    ADV_NORMAL, // adaptive readahead, blocks cached at normal priority
+    ADV_SEQUENTIAL, // the file is read once from start to end
+    ADV_RANDOM, // no readahead
+    ADV_WILLNEED, // read the whole file into the cache now
+    ADV_DONTNEED, // drop the file from the cache, later reads pass through
+    ADV_COUNT
+};
+
+extern const char *advice_names[ADV_COUNT];
+// the fs_advice called <name>, or -1
+int parse_advice(const std::string &name);
+
+// delayed files are flushed once this much data is waiting in memory
+#define DELAYED_MAX (2 * 1024 * 1024)
+
+class TraceRecorder;
+class AsyncFS;
+
+// attributes of a file as returned by FS::stat
+struct fs_stat {
+    uint32_t size;
+    uint16_t first_blk;
+    uint8_t type;
+    uint8_t access_rights;
+    uint32_t allocated; // bytes in the block chain, can exceed size
+    bool compressed;
+};
+
+// The used entries of a directory, for range-for loops. The entries are
+// views into the resident directory block, and the directory lock is held
+// while the DirView exists, so no other FS call may be made until it is
+// destroyed.
+class DirView {
+public:
+    class iterator {
+    public:
+        iterator(const dir_entry *entries, uint64_t left) : entries(entries), left(left) {}
+        const dir_entry &operator*() const { return entries[__builtin_ctzll(left)]; }
+        const dir_entry *operator->() const { return &**this; }
+        iterator &operator++() { left &= left - 1; return *this; }
+        bool operator!=(const iterator &o) const { return left != o.left; }
+    private:
+        const dir_entry *entries;
+        uint64_t left; // entries not visited yet, one bit each
+    };
+
+    iterator begin() const { return iterator(entries, used); }
+    iterator end() const { return iterator(entries, 0); }
+
+private:
+    friend class FS;
+    // <used> is read once the lock is held
+    DirView(std::mutex &m, const dir_entry *entries, const uint64_t &used)
+        : lock(m), entries(entries), used(used) {}
+    std::unique_lock<std::mutex> lock;
+    const dir_entry *entries;
+    uint64_t used;
+};
+
+struct alloc_group {
+    std::mutex lock;
+    unsigned first; // first block in the group
+    unsigned last; // one past the last block in the group
+    unsigned nfree; // number of free blocks in the group
+    unsigned hint; // no free block below this index
+};
+
 class FS {
 private:
+    // the awaitable API in async.h reuses the internals below
+    friend class AsyncFS;
+
     Disk disk;
     // size of a FAT entry is 2 bytes
-    int16_t fat[BLOCK_SIZE/2];
+    FSGeometry::fat_entry fat[FSGeometry::blocks];
+    alloc_group groups[ALLOC_GROUPS];
+    IOStats counters;
+    // data blocks go through the cache, the metadata is resident anyway
+    BlockCache cache;
+    // readahead state of the files being read, keyed by first block
+    struct ra_stream {
+        uint32_t next; // block expected next if the reads are sequential
+        uint32_t ahead; // one past the last block read ahead
+        unsigned window; // 0 until the reads look sequential
+        uint64_t used; // for forgetting the oldest stream
+    };
+    std::map<uint16_t, ra_stream> streams;
+    uint64_t stream_clock;
+    // hints given by advise, keyed by first block like the streams
+    std::map<uint16_t, int> hints;
+    std::mutex ra_lock;
+    // resident copy of the root directory block
+    unsigned char root[BLOCK_SIZE];
+    // hashes, sizes and occupancy of <root> in dense arrays
+    DirMirror<FSGeometry> dir;
+    // serializes access to the root directory and the batch state
+    std::mutex dir_lock;
+    // files whose blocks are being read outside dir_lock, keyed by first_blk;
+    // rm and append wait until a file is no longer pinned
+    std::map<uint16_t, int> pins;
+    std::condition_variable unpinned;
+    // print a banner for every call
+    bool verbose;
+    // overlap reading and writing in cp and append
+    bool pipelined;
+    // receives every public call when a trace is being recorded
+    TraceRecorder *recorder;
+    // inside begin()/commit() FAT and directory writes are deferred
+    bool batching;
+    bool fat_dirty;
+    bool dir_dirty;
+    // chains released by rm inside a batch, freed at commit
+    std::vector<uint16_t> deferred;
+    // free blocks not promised to delayed files; allocations outside a
+    // flush claim one before they scan
+    std::atomic<long> avail;
+    // delayed allocation: the data of new files waits here, keyed by
+    // directory slot, until a flush gives it blocks. Guarded by dir_lock.
+    bool delayed;
+    std::map<int, std::string> pending;
+    uint64_t pending_bytes;
+    // new files are stored compressed
+    bool compressing;
+    // deduplication: a new file with the contents of an existing one and
+    // a copy made by cp share its chain. The index maps content hashes to
+    // first blocks; it is guarded by dir_lock, and since files change and
+    // go away every hit is checked against a live entry and its data.
+    bool dedup;
+    std::multimap<uint64_t, uint16_t> dedup_index;
+    // freed blocks waiting to be punched out of the image by the discard
+    // thread, which rechecks under the group lock that they are still free
+    std::vector<int> discards;
+    std::mutex discard_lock;
+    std::condition_variable discard_cond;
+    bool discard_stop;
+    std::thread discarder;
+    // writes the dirty blocks of the cache back while write-back is on
+    std::thread flusher;
+    // CRC-32C of every block, kept up to date by the disk on each write
+    // and checked on each read. store_sums writes the blocks of the
+    // checksum region that changed since <sums_stored>. The region took
+    // blocks that held data before it existed: older volumes are not
+    // readable and have to be formatted.
+    std::atomic<uint32_t> sums[FSGeometry::blocks];
+    uint32_t sums_stored[FSGeometry::csum_blocks * BLOCK_SIZE / sizeof(uint32_t)];
+    std::mutex sums_lock;
+    bool checksums;
+    // the background scrub and the result of the last one
+    std::thread scrubber;
+    std::mutex scrub_lock;
+    bool scrub_running;
+    int scrub_ret;
+    std::vector<int> scrub_bad;
+
+    block_class class_of(int blk);
+    // block I/O goes through these so it is counted per block class
+    int read_block(int blk, uint8_t *buf, bool low = false);
+    int write_block(int blk, uint8_t *buf);
+    int write_run(int blk, unsigned n, const uint8_t *buf);
+    void load_fat();
+    void store_fat();
+    void load_dir();
+    void store_dir();
+    void load_sums();
+    void store_sums();
+    // moves file blocks out of the checksum region of an old volume
+    int migrate_region();
+    // writes zeros over the whole image, where it cannot be punched
+    int zero_blocks();
+    void scrub_run(unsigned threads);
+    // fills in the magic and the CRC of a checksum region, or checks them
+    static void seal_region(uint32_t *region);
+    static bool region_valid(const uint32_t *region);
+    void init_groups();
+    int group_of(int blk);
+    int home_group();
+    // allocates a free block, preferring the group of <near> (or the
+    // calling thread's own group), stealing from the others when it is full
+    int alloc_block(int near, bool reserved = false);
+    // allocates and links <n> contiguous blocks from the reservation,
+    // returns the first one or -1 if no run is long enough
+    int alloc_run(unsigned n);
+    bool reserve(unsigned n);
+    void unreserve(unsigned n);
+    void set_fat(int blk, int16_t value);
+    void free_chain(int blk);
+    void discard_loop();
+    void flush_loop();
+    void discard_blocks(std::vector<int> &blocks);
+    // allocates <n> blocks, as one run if there is one, and links them
+    // after <tail> (-1 starts a new chain). <first> is the first new block.
+    int extend_chain(int tail, unsigned n, int &first);
+    // number of blocks in the whole chain starting at <blk>, with the
+    // blocks reserved past the end of the file
+    unsigned chain_length(int blk);
+    int find_entry(dir_entry *entries, const std::string &name);
+    int find_entry(dir_entry *entries, const char *name, size_t len);
+    int free_entry();
+    void pin(uint16_t blk);
+    void unpin(uint16_t blk);
+    bool pinned(uint16_t blk);
+    // called before block <k> of the file <first> of <nblocks> blocks is
+    // read, with <c> at that block; starts reading ahead if it is time
+    void readahead(uint16_t first, uint32_t k, uint32_t nblocks, ChainCursor c);
+    int hint_of(uint16_t first);
+    // whether blocks read under hint <h> are cached at low priority
+    static bool scan_hint(int h) { return h == ADV_SEQUENTIAL || h == ADV_DONTNEED; }
+    // collects the blocks holding the first <size> bytes of a chain
+    void chain_blocks(int blk, uint32_t size, std::vector<int> &blocks);
+    int check_new(const std::string &filepath);
+    int write_chain(const char *data, uint32_t size, uint16_t &first_blk);
+    // whether the block at <done> of a new file becomes a hole
+    static bool skip_block(const char *chunk, uint32_t done, uint32_t size, unsigned holes);
+    // with <delayed_data> the entry gets no blocks yet, the data is kept
+    // in memory until the file is flushed
+    int add_entry(const std::string &filepath, uint32_t size, uint16_t first_blk, uint8_t rights,
+                  uint8_t type = TYPE_FILE, const char *delayed_data = nullptr);
+    // fills the free directory slot <i>. dir_lock held.
+    void link_entry(int i, const std::string &filepath, uint32_t size, uint16_t first_blk,
+                    uint8_t rights, uint8_t type);
+    // writes the data of a file of <type>, compressed if the type says so
+    int store_chain(const char *data, uint32_t size, uint8_t type, uint16_t &first_blk);
+    // Chains may be shared by several entries, see dedup. The rest run
+    // with dir_lock held: find_dup returns the first block of a file
+    // holding <data>, or 0; release_chain frees a chain once no entry
+    // refers to it; unshare gives entry <i> a private copy.
+    uint16_t find_dup(uint64_t hash, const char *data, uint32_t size, uint8_t type);
+    void release_chain(uint16_t first_blk);
+    int unshare(int i);
+    // writes a new file, now or delayed
+    int store_file(const std::string &filepath, const char *data, uint32_t size);
+    // The steps of store_file around writing the chain, shared with
+    // AsyncFS. begin_file stores the file at once when it needs no chain of
+    // its own, as a duplicate or a delayed file, and sets <f.done>. Else
+    // the caller writes the chain of type <f.type> and calls finish_file.
+    struct new_file {
+        uint8_t type;
+        uint64_t hash; // of the contents, when dedup is on
+        bool done;
+    };
+    int begin_file(const std::string &filepath, const char *data, uint32_t size, new_file &f);
+    int finish_file(const std::string &filepath, uint32_t size, uint16_t first_blk,
+                    const new_file &f);
+    // gives the delayed file in slot <index> its blocks and writes its data;
+    // flush_pending also stores the FAT and the directory. dir_lock held.
+    int place_pending(int index);
+    int flush_pending(int index);
+    int flush_all_pending();
+    // stat and read without timing or recording them, for cat
+    int stat_file(const char *filepath, fs_stat &st);
+    int read_file(const char *filepath, char *buf, uint32_t len, uint32_t offset);
+    // the <n> bytes at <offset> of the file <e>, which is pinned; 0 or -4
+    int read_data(const dir_entry &e, char *buf, uint32_t n, uint32_t offset);
+    int read_packed(const dir_entry &e, char *buf, uint32_t n, uint32_t offset);
+    // copies <len> bytes at <pos> of the byte stream kept in <blocks>
+    int read_stream(const std::vector<int> &blocks, uint32_t pos, uint32_t len, uint8_t *out);
+    // the on-disk form of <size> bytes of a compressed file
+    static void pack(const char *data, uint32_t size, std::string &stream);
+    int append_packed(int i1, int i2);
 
 public:
-    FS();
+    // mounts the volume in the image file <image>
+    FS(bool verbose = true, const char *image = DISKNAME);
     ~FS();
     // formats the disk, i.e., creates an empty file system
     int format();
     // create <filepath> creates a new file on the disk, the data content is
     // written on the following rows (ended with an empty row)
     int create(std::string filepath);
+    // creates a new file with <size> bytes of content taken from <data>
+    // instead of standard input, safe to call from several threads
+    int create(std::string filepath, const char *data, uint32_t size);
     // cat <filepath> reads the content of a file and prints it on the screen
     int cat(std::string filepath);
     // ls lists the content in the current directory (files and sub-directories)
     int ls();
 
+    // Structured queries that do not print. stat fills <st> for <filepath>.
+    // read copies up to <len> bytes of <filepath> starting at <offset> to
+    // <buf> and returns the number of bytes copied. Both return -2 if the
+    // file does not exist, read returns -3 for a directory and -4 on an I/O
+    // error.
+    int stat(const char *filepath, fs_stat &st);
+    int read(const char *filepath, char *buf, uint32_t len, uint32_t offset = 0);
+    // the used entries of the current directory, see DirView
+    DirView readdir();
+
     // cp <sourcepath> <destpath> makes an exact copy of the file
     // <sourcepath> to a new file <destpath>
     int cp(std::string sourcepath, std::string destpath);
@@ -54,6 +404,19 @@ public:
     // append <filepath1> <filepath2> appends the contents of file <filepath1> to
     // the end of file <filepath2>. The file <filepath1> is unchanged.
     int append(std::string filepath1, std::string filepath2);
+    // fallocate <filepath> <size> reserves blocks for <size> bytes of
+    // <filepath> as one contiguous extent when possible, creating the file
+    // if it does not exist. The file size stays the same; append fills the
+    // reserved blocks before it allocates new ones. Returns -3 for a
+    // directory, -5 if the disk is full and -6 for a compressed file,
+    // which keeps no reserve.
+    int fallocate(std::string filepath, uint32_t size);
+
+    // advise <filepath> <hint> tells how the file will be read, see
+    // fs_advice. The hint sticks to the file until it is replaced or the
+    // file is removed. Returns -1 for an unknown hint, -2 if the file does
+    // not exist and -3 for a directory.
+    int advise(std::string filepath, int hint);
 
     // mkdir <dirpath> creates a new sub-directory with the name <dirpath>
     // in the current directory
@@ -67,6 +430,69 @@ public:
     // chmod <accessrights> <filepath> changes the access rights for the
     // file <filepath> to <accessrights>.
     int chmod(std::string accessrights, std::string filepath);
+
+    // begin starts a batch: metadata changes stay in memory until commit
+    int begin();
+    // commit writes the FAT and the directory changed since begin once
+    int commit();
+
+    // Delayed allocation: created files stay in memory and get one
+    // contiguous run of blocks when they are flushed, by sync(), commit(),
+    // any call that needs their blocks, or once DELAYED_MAX bytes wait.
+    // Files removed before that never reach the disk. Until the flush the
+    // entry on disk has size 0.
+    void set_delayed(bool on);
+    int sync();
+
+    // Compression: files created while it is on are stored as LZ
+    // compressed chunks of BLOCK_SIZE bytes and decompressed on read. The
+    // setting sticks to the file, appends to it stay compressed.
+    void set_compression(bool on);
+
+    // Deduplication: while it is on, create shares the chain of an
+    // existing file with the same contents and cp shares the chain of its
+    // source, neither writes any data. A shared chain is copied before
+    // append or fallocate change it, and freed with its last entry.
+    void set_dedup(bool on);
+
+    // Write-back: while it is on, data blocks are written to the cache
+    // only and a background thread writes them to the disk once they are
+    // WB_AGE_MS old or too much of the cache is dirty. The FAT and the
+    // directory are still written at once, so after a crash a file may
+    // hold up to WB_AGE_MS of stale data. sync() writes everything.
+    void set_writeback(bool on);
+
+    // scrub reads every metadata block and every allocated data block with
+    // <threads> threads and checks them against their checksums. It takes
+    // no lock for long, so other calls may run meanwhile. Returns the
+    // number of blocks checked, with the damaged ones in <bad>, or -1 if
+    // the volume has no checksums.
+    int scrub(unsigned threads, std::vector<int> &bad);
+    // scrub_start runs scrub in a thread of its own and returns at once,
+    // -1 if the volume has no checksums and -2 if a scrub is running.
+    // scrub_status returns 1 while it runs, -3 if no scrub has run since
+    // the volume was mounted, else the result of the last scrub with its
+    // damaged blocks in <bad>.
+    int scrub_start(unsigned threads);
+    int scrub_status(std::vector<int> &bad);
+
+    // stats fills <s> with a snapshot of the I/O counters and the latency
+    // histograms, reset_stats clears them
+    void stats(fs_stats &s);
+    void reset_stats();
+
+    // records every call to <recorder>, nullptr stops recording
+    void set_recorder(TraceRecorder *r) { recorder = r; }
+
+    // turns the per-call banners on or off
+    void set_verbose(bool on) { verbose = on; }
+    // selects the serial (default) or the pipelined copy path in cp and
+    // append. The pipeline reads block k+1 while block k is written, which
+    // only pays off when the device has real latency; with the image in the
+    // page cache the handoff costs more than it saves.
+    void set_pipelined(bool on) { pipelined = on; }
+    // simulated latency of every disk call, see Disk::set_latency
+    void set_io_latency(unsigned us) { disk.set_latency(us); }
 };
 
 #endif // __FS_H__
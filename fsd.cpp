@@ -0,0 +1,41 @@
+// File system daemon: mounts the image once and serves it to local clients
+// over a Unix domain socket, see proto.h for the protocol.
+//
+// Usage: fsd [-w workers] [socket]   (default: 4 workers on fs.sock)
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include "fs.h"
+#include "server.h"
+#include "proto.h"
+
+int
+main(int argc, char **argv)
+{
+    int workers = 4;
+    const char *path = FSD_SOCKET;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            workers = std::atoi(argv[++i]);
+        } else if (argv[i][0] != '-') {
+            path = argv[i];
+        } else {
+            std::cerr << "Usage: fsd [-w workers] [socket]\n";
+            return 1;
+        }
+    }
+    if (workers < 1) {
+        workers = 1;
+    }
+
+    FS fs(false);
+    Server server(fs, workers);
+    if (server.listen(path) != 0) {
+        std::cerr << "fsd: cannot listen on " << path << ": " << std::strerror(errno) << "\n";
+        return 1;
+    }
+    std::cerr << "fsd: serving " << DISKNAME << " on " << path << " with "
+              << workers << " workers\n";
+    return server.run() == 0 ? 0 : 1;
+}
@@ -0,0 +1,298 @@
+// Load generator for fsd. Opens <conns> connections, keeps <depth> requests
+// in flight on each for <seconds> and reports requests/sec and latency.
+//
+// Usage: fsload [-c conns] [-d depth] [-t seconds] [-op stat|read|ls|mixed] [socket]
+//
+// The files it reads, load0 to load15, are created first if they do not
+// exist yet.
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "proto.h"
+
+#define LOAD_FILES 16
+#define LOAD_FILE_SIZE 4096
+
+typedef std::chrono::steady_clock clk;
+
+enum load_op { LOAD_STAT, LOAD_READ, LOAD_LS, LOAD_MIXED };
+
+static int
+connect_to(const char *path)
+{
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool
+write_all(int fd, const std::string &b)
+{
+    size_t done = 0;
+    while (done < b.size()) {
+        ssize_t n = ::write(fd, b.data() + done, b.size() - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += n;
+    }
+    return true;
+}
+
+// reads whole response frames from a socket through a buffer
+class FrameStream {
+public:
+    explicit FrameStream(int fd) : fd(fd), pos(0) {}
+
+    // the next frame without its length word, false on EOF or error
+    bool next(std::string &frame)
+    {
+        if (!fill(4)) return false;
+        uint32_t len = get_u32(buf.data() + pos);
+        if (!fill(4 + len)) return false;
+        frame.assign(buf, pos + 4, len);
+        pos += 4 + len;
+        return true;
+    }
+
+private:
+    int fd;
+    std::string buf;
+    size_t pos;
+
+    bool fill(size_t n)
+    {
+        if (pos > 0 && buf.size() - pos < n) {
+            buf.erase(0, pos);
+            pos = 0;
+        }
+        char tmp[65536];
+        while (buf.size() - pos < n) {
+            ssize_t got = ::read(fd, tmp, sizeof(tmp));
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0) return false;
+            buf.append(tmp, got);
+        }
+        return true;
+    }
+};
+
+static std::string
+file_name(unsigned k)
+{
+    return "load" + std::to_string(k % LOAD_FILES);
+}
+
+static void
+build_request(std::string &b, uint32_t id, load_op op)
+{
+    if (op == LOAD_MIXED) {
+        op = static_cast<load_op>(id % 3);
+    }
+    size_t start = begin_frame(b, id);
+    std::string name = file_name(id);
+    switch (op) {
+    case LOAD_STAT:
+        put_u8(b, REQ_STAT);
+        put_str(b, name.data(), name.size());
+        break;
+    case LOAD_READ:
+        put_u8(b, REQ_READ);
+        put_str(b, name.data(), name.size());
+        put_u32(b, 0);
+        put_u32(b, LOAD_FILE_SIZE);
+        break;
+    default:
+        put_u8(b, REQ_READDIR);
+        break;
+    }
+    finish_frame(b, start);
+}
+
+// creates the files the requests refer to, existing ones are kept
+static bool
+setup(const char *path)
+{
+    int fd = connect_to(path);
+    if (fd == -1) {
+        return false;
+    }
+    std::string data(LOAD_FILE_SIZE, 'x');
+    std::string b;
+    for (unsigned k = 0; k < LOAD_FILES; k++) {
+        size_t start = begin_frame(b, k);
+        std::string name = file_name(k);
+        put_u8(b, REQ_CREATE);
+        put_str(b, name.data(), name.size());
+        put_u32(b, data.size());
+        b += data;
+        finish_frame(b, start);
+    }
+    bool ok = write_all(fd, b);
+    FrameStream in(fd);
+    std::string frame;
+    for (unsigned k = 0; ok && k < LOAD_FILES; k++) {
+        ok = in.next(frame);
+    }
+    ::close(fd);
+    return ok;
+}
+
+struct client_result {
+    std::vector<double> latencies; // microseconds per request
+    long errors;
+    bool failed;
+};
+
+static void
+client(const char *path, load_op op, int depth, clk::time_point deadline,
+       client_result &res)
+{
+    res.errors = 0;
+    res.failed = true;
+    int fd = connect_to(path);
+    if (fd == -1) {
+        return;
+    }
+    FrameStream in(fd);
+    std::deque<clk::time_point> sent;
+    std::string b, frame;
+    uint32_t id = 0;
+
+    // responses come back in order, so the oldest send time is theirs
+    for (int d = 0; d < depth; d++) {
+        build_request(b, id++, op);
+        sent.push_back(clk::now());
+    }
+    if (!write_all(fd, b)) {
+        ::close(fd);
+        return;
+    }
+    while (!sent.empty()) {
+        if (!in.next(frame) || frame.size() < 8) {
+            ::close(fd);
+            return;
+        }
+        clk::time_point now = clk::now();
+        std::chrono::duration<double, std::micro> t = now - sent.front();
+        sent.pop_front();
+        res.latencies.push_back(t.count());
+        if (static_cast<int32_t>(get_u32(frame.data() + 4)) < 0) {
+            res.errors++;
+        }
+        if (now < deadline) {
+            b.clear();
+            build_request(b, id++, op);
+            sent.push_back(clk::now());
+            if (!write_all(fd, b)) {
+                ::close(fd);
+                return;
+            }
+        }
+    }
+    ::close(fd);
+    res.failed = false;
+}
+
+static double
+percentile(std::vector<double> &v, double p)
+{
+    if (v.empty()) {
+        return 0;
+    }
+    size_t i = (size_t)(p * (v.size() - 1) + 0.5);
+    std::nth_element(v.begin(), v.begin() + i, v.end());
+    return v[i];
+}
+
+int
+main(int argc, char **argv)
+{
+    int conns = 4, depth = 16;
+    double seconds = 5;
+    load_op op = LOAD_STAT;
+    const char *path = FSD_SOCKET;
+    const char *op_names[] = { "stat", "read", "ls", "mixed" };
+
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        if (a == "-c" && i + 1 < argc) {
+            conns = std::atoi(argv[++i]);
+        } else if (a == "-d" && i + 1 < argc) {
+            depth = std::atoi(argv[++i]);
+        } else if (a == "-t" && i + 1 < argc) {
+            seconds = std::atof(argv[++i]);
+        } else if (a == "-op" && i + 1 < argc) {
+            std::string name = argv[++i];
+            int k = 0;
+            while (k < 4 && name != op_names[k]) k++;
+            if (k == 4) {
+                std::cerr << "fsload: unknown op " << name << "\n";
+                return 1;
+            }
+            op = static_cast<load_op>(k);
+        } else if (a[0] != '-') {
+            path = argv[i];
+        } else {
+            std::cerr << "Usage: fsload [-c conns] [-d depth] [-t seconds] "
+                         "[-op stat|read|ls|mixed] [socket]\n";
+            return 1;
+        }
+    }
+    if (conns < 1) conns = 1;
+    if (depth < 1) depth = 1;
+
+    if (!setup(path)) {
+        std::cerr << "fsload: cannot talk to fsd on " << path << "\n";
+        return 1;
+    }
+
+    std::vector<client_result> results(conns);
+    std::vector<std::thread> threads;
+    clk::time_point start = clk::now();
+    clk::time_point deadline = start + std::chrono::microseconds((long)(seconds * 1e6));
+    for (int c = 0; c < conns; c++) {
+        threads.push_back(std::thread(client, path, op, depth, deadline,
+                                      std::ref(results[c])));
+    }
+    for (size_t c = 0; c < threads.size(); c++) {
+        threads[c].join();
+    }
+    std::chrono::duration<double> elapsed = clk::now() - start;
+
+    std::vector<double> all;
+    long errors = 0;
+    int failed = 0;
+    for (size_t c = 0; c < results.size(); c++) {
+        all.insert(all.end(), results[c].latencies.begin(), results[c].latencies.end());
+        errors += results[c].errors;
+        failed += results[c].failed;
+    }
+    std::cout << "requests " << all.size() << ", errors " << errors
+              << ", failed connections " << failed << ", op " << op_names[op]
+              << ", conns " << conns << ", depth " << depth << "\n";
+    std::cout << "req_per_sec,p50_us,p99_us\n";
+    std::cout << all.size() / elapsed.count() << ","
+              << percentile(all, 0.50) << ","
+              << percentile(all, 0.99) << "\n";
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,51 @@
+#include <cstdint>
+
+#ifndef __GEOMETRY_H__
+#define __GEOMETRY_H__
+
+// number of bits needed to write <n>
+constexpr unsigned
+geometry_bits(unsigned n)
+{
+    return n ? 1 + geometry_bits(n >> 1) : 0;
+}
+
+// Volume layout derived at compile time from the block size, the FAT entry
+// type, the number of blocks and the directory entry type. Block 0 holds the
+// root directory, the FAT follows from block 1, then the checksum region
+// with a CRC-32C for every block, and the rest is data. FS is instantiated
+// for one geometry only, FSGeometry in fs.h; the template keeps the derived
+// constants in one place and lets DirMirror and the lookups use them as
+// compile-time trip counts.
+template <unsigned BlockSize, typename FatEntry, unsigned Blocks, typename DirEntry>
+struct Geometry {
+    typedef FatEntry fat_entry;
+    typedef DirEntry dir_entry;
+
+    static constexpr unsigned block_size = BlockSize;
+    static constexpr unsigned blocks = Blocks;
+    static constexpr unsigned dir_entries = BlockSize / sizeof(DirEntry);
+    static constexpr unsigned fat_entries_per_block = BlockSize / sizeof(FatEntry);
+    static constexpr unsigned fat_blocks =
+        (Blocks + fat_entries_per_block - 1) / fat_entries_per_block;
+    static constexpr unsigned csum_block = 1 + fat_blocks;
+    static constexpr unsigned csum_blocks =
+        (Blocks * sizeof(uint32_t) + BlockSize - 1) / BlockSize;
+    static constexpr unsigned first_data_block = csum_block + csum_blocks;
+    static constexpr unsigned data_blocks = Blocks - first_data_block;
+    static constexpr uint64_t max_file_size = (uint64_t)data_blocks * BlockSize;
+    // A FAT link keeps the next block in its low link_bits. The bits above
+    // them, up to the sign bit, count the hole blocks that come before it.
+    static constexpr unsigned link_bits = geometry_bits(Blocks - 1);
+    static constexpr unsigned max_holes =
+        (1u << (8 * sizeof(FatEntry) - 1 - link_bits)) - 1;
+
+    static_assert(BlockSize % sizeof(DirEntry) == 0,
+                  "directory entries must not straddle blocks");
+    static_assert(((uint64_t)1 << (8 * sizeof(FatEntry) - 1)) >= Blocks,
+                  "FAT entries must be able to address every block");
+    static_assert(csum_blocks >= 2, "the checksum region needs two entries of its own");
+    static_assert(first_data_block < Blocks, "no room for data blocks");
+};
+
+#endif // __GEOMETRY_H__
@@ -0,0 +1,144 @@
+#include <cstring>
+#include "lz.h"
+
+// positions are hashed on their first four bytes
+#define LZ_HASH_BITS 12
+// the last bytes are always literals, so a match never runs off the input
+#define LZ_LAST_LITERALS 5
+
+static uint32_t
+read32(const uint8_t *p)
+{
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned
+lz_hash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// writes the part of <len> that did not fit in the token's nibble
+static bool
+put_length(uint8_t *&op, const uint8_t *end, unsigned len)
+{
+    while (len >= 255) {
+        if (op == end) return false;
+        *op++ = 255;
+        len -= 255;
+    }
+    if (op == end) return false;
+    *op++ = len;
+    return true;
+}
+
+static bool
+get_length(const uint8_t *&ip, const uint8_t *end, unsigned &len)
+{
+    uint8_t b;
+    do {
+        if (ip == end) return false;
+        b = *ip++;
+        len += b;
+    } while (b == 255);
+    return true;
+}
+
+// one record: the literals [lit, lit + nlit) and, if <mlen> is not zero, a
+// match of <mlen> bytes <offset> back
+static bool
+put_record(uint8_t *&op, const uint8_t *end, const uint8_t *lit, unsigned nlit,
+           unsigned offset, unsigned mlen)
+{
+    if (op == end) return false;
+    uint8_t *token = op++;
+    unsigned m = mlen ? mlen - LZ_MIN_MATCH : 0;
+    *token = ((nlit < 15 ? nlit : 15) << 4) | (m < 15 ? m : 15);
+    if (nlit >= 15 && !put_length(op, end, nlit - 15)) return false;
+    if ((unsigned)(end - op) < nlit) return false;
+    std::memcpy(op, lit, nlit);
+    op += nlit;
+    if (mlen == 0) {
+        return true;
+    }
+    if (end - op < 2) return false;
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    return m < 15 || put_length(op, end, m - 15);
+}
+
+int
+lz_compress(const uint8_t *src, int n, uint8_t *dst, int cap)
+{
+    int table[1 << LZ_HASH_BITS];
+    for (int i = 0; i < (1 << LZ_HASH_BITS); i++) {
+        table[i] = -1;
+    }
+    const uint8_t *ip = src, *anchor = src;
+    const uint8_t *limit = n > LZ_LAST_LITERALS ? src + n - LZ_LAST_LITERALS : src;
+    uint8_t *op = dst;
+    const uint8_t *oend = dst + cap;
+
+    while (ip + LZ_MIN_MATCH <= limit) {
+        uint32_t v = read32(ip);
+        unsigned h = lz_hash(v);
+        int ref = table[h];
+        table[h] = ip - src;
+        if (ref < 0 || (ip - src) - ref > 65535 || read32(src + ref) != v) {
+            ip++;
+            continue;
+        }
+        const uint8_t *m = src + ref;
+        unsigned mlen = LZ_MIN_MATCH;
+        while (ip + mlen < limit && ip[mlen] == m[mlen]) {
+            mlen++;
+        }
+        if (!put_record(op, oend, anchor, ip - anchor, ip - m, mlen)) {
+            return 0;
+        }
+        ip += mlen;
+        anchor = ip;
+    }
+    if (!put_record(op, oend, anchor, src + n - anchor, 0, 0)) {
+        return 0;
+    }
+    return op - dst;
+}
+
+int
+lz_decompress(const uint8_t *src, int n, uint8_t *dst, int cap)
+{
+    const uint8_t *ip = src, *iend = src + n;
+    uint8_t *op = dst, *oend = dst + cap;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        unsigned nlit = token >> 4;
+        if (nlit == 15 && !get_length(ip, iend, nlit)) return -1;
+        if ((unsigned)(iend - ip) < nlit || (unsigned)(oend - op) < nlit) return -1;
+        std::memcpy(op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == iend) {
+            break;
+        }
+        if (iend - ip < 2) return -1;
+        unsigned offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        unsigned mlen = token & 15;
+        if (mlen == 15 && !get_length(ip, iend, mlen)) return -1;
+        mlen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (unsigned)(op - dst) || (unsigned)(oend - op) < mlen) {
+            return -1;
+        }
+        // byte by byte, the match may overlap what it produces
+        const uint8_t *m = op - offset;
+        for (unsigned i = 0; i < mlen; i++) {
+            op[i] = m[i];
+        }
+        op += mlen;
+    }
+    return op - dst;
+}
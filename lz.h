@@ -0,0 +1,28 @@
+#include <cstdint>
+
+#ifndef __LZ_H__
+#define __LZ_H__
+
+// A small LZ77 codec in the style of LZ4, used for compressed files. The
+// input is a sequence of records:
+//
+//   u8 token        literal count in the high nibble, match length - 4 in
+//                   the low nibble; 15 means more bytes follow
+//   [u8 ...]        rest of the literal count, bytes of 255 and a final one
+//   literals
+//   u16 offset      little endian, distance back to the match
+//   [u8 ...]        rest of the match length
+//
+// The last record has literals only. Offsets are limited to 64 KiB, which
+// is more than one compression chunk.
+
+#define LZ_MIN_MATCH 4
+
+// compresses <n> bytes at <src> into <dst>, which has room for <cap> bytes.
+// Returns the compressed length, or 0 if it would not fit.
+int lz_compress(const uint8_t *src, int n, uint8_t *dst, int cap);
+// decompresses <n> bytes at <src> into <dst>, which has room for <cap>
+// bytes. Returns the decompressed length, or -1 for corrupt input.
+int lz_decompress(const uint8_t *src, int n, uint8_t *dst, int cap);
+
+#endif // __LZ_H__
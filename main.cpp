@@ -1,10 +1,24 @@
+#include <iostream>
+#include <unistd.h>
 #include "shell.h"
 #include "fs.h"
 #include "disk.h"
 
+// size of the stdout buffer when the shell is driven from a pipe
+#define OUTPUT_BUFFER (1 << 20)
+
 int
-main(int argc, char **argv)
+main()
 {
+    // without a terminal on stdin the shell runs quietly (see Shell::Shell)
+    // and stdout goes through one large buffer
+    static char output_buffer[OUTPUT_BUFFER];
+    if (!isatty(0)) {
+        std::ios::sync_with_stdio(false);
+        // reading a command must not flush the output
+        std::cin.tie(nullptr);
+        std::cout.rdbuf()->pubsetbuf(output_buffer, OUTPUT_BUFFER);
+    }
     Shell shell;
     shell.run();
     return 0;
@@ -0,0 +1,94 @@
+#include <cstring>
+#include "pipeline.h"
+
+ChainReader::ChainReader(BlockCache &cache, IOStats *stats, const std::vector<int> &blocks, bool threaded)
+    : cache(cache), stats(stats), blocks(blocks), threaded(threaded),
+      produced(0), consumed(0), stop(false)
+{
+    if (threaded) {
+        reader = std::thread(&ChainReader::read_loop, this);
+    }
+}
+
+ChainReader::~ChainReader()
+{
+    if (threaded) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stop = true;
+        }
+        cond.notify_all();
+        reader.join();
+    }
+}
+
+// a negative block number is a hole of a sparse file and reads as zeros
+int
+ChainReader::fetch(unsigned k, uint8_t *buf)
+{
+    if (blocks[k] < 0) {
+        std::memset(buf, 0, BLOCK_SIZE);
+        return 0;
+    }
+    if (stats) stats->read(BLK_DATA);
+    return cache.read(blocks[k], buf);
+}
+
+void
+ChainReader::read_loop()
+{
+    for (unsigned k = 0; k < blocks.size(); k++) {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            while (!stop && produced - consumed == RING_SIZE) {
+                cond.wait(guard);
+            }
+            if (stop) {
+                return;
+            }
+        }
+        // the slot is ours until produced is bumped
+        int ret = fetch(k, ring[k % RING_SIZE]);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            status[k % RING_SIZE] = ret;
+            produced++;
+        }
+        cond.notify_all();
+    }
+}
+
+const uint8_t *
+ChainReader::next()
+{
+    unsigned slot = consumed % RING_SIZE;
+    if (!threaded) {
+        if (consumed >= blocks.size()) {
+            return nullptr;
+        }
+        status[slot] = fetch(consumed, ring[slot]);
+    } else {
+        std::unique_lock<std::mutex> guard(lock);
+        if (consumed >= blocks.size()) {
+            return nullptr;
+        }
+        while (produced == consumed) {
+            cond.wait(guard);
+        }
+    }
+    return status[slot] == 0 ? ring[slot] : nullptr;
+}
+
+void
+ChainReader::release()
+{
+    if (!threaded) {
+        consumed++;
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        consumed++;
+    }
+    cond.notify_all();
+}
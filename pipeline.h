@@ -0,0 +1,44 @@
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "cache.h"
+#include "stats.h"
+
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+// number of block buffers shared by the read and write stages
+#define RING_SIZE 4
+
+// Reads a list of blocks in order. When threaded, a reader thread fills a
+// small ring of buffers so that block k+1 is read while the caller is still
+// writing block k; otherwise every block is read on demand. Negative block
+// numbers are holes and come back as zeros.
+class ChainReader {
+private:
+    BlockCache &cache;
+    IOStats *stats;
+    const std::vector<int> &blocks;
+    bool threaded;
+    uint8_t ring[RING_SIZE][BLOCK_SIZE];
+    int status[RING_SIZE];
+    unsigned produced; // blocks read into the ring
+    unsigned consumed; // blocks released by the caller
+    bool stop;
+    std::mutex lock;
+    std::condition_variable cond;
+    std::thread reader;
+    void read_loop();
+    int fetch(unsigned k, uint8_t *buf);
+public:
+    ChainReader(BlockCache &cache, IOStats *stats, const std::vector<int> &blocks, bool threaded);
+    ~ChainReader();
+    // returns the next block, or nullptr if it could not be read
+    const uint8_t *next();
+    // hands the buffer returned by next() back to the reader
+    void release();
+};
+
+#endif // __PIPELINE_H__
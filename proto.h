@@ -0,0 +1,158 @@
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#ifndef __PROTO_H__
+#define __PROTO_H__
+
+// Binary protocol of the file system daemon. Every message is a frame
+//
+//   u32 length of the rest of the frame
+//   u32 request id, echoed in the response
+//
+// followed in a request by a u8 op and its arguments, and in a response by
+// an i32 status (the return value of the FS call) and the result. Integers
+// are little endian, strings are a u16 length and the bytes. A client may
+// send any number of requests without waiting; the responses of one
+// connection come back in request order.
+//
+//   op           arguments                   result
+//   REQ_STAT     name                        u32 size, u16 first_blk, u8 type, u8 rights
+//   REQ_READ     name, u32 offset, u32 len   the data, status is its length
+//   REQ_READDIR                              per entry: name, u32 size, u8 type,
+//                                            u8 rights; status is the count
+//   REQ_CREATE   name, u32 size, data
+//   REQ_CP       source, destination
+//   REQ_MV       source, destination
+//   REQ_RM       name
+//   REQ_APPEND   source, destination
+//   REQ_FORMAT                               PROTO_EBUSY while other
+//                                            requests are running
+enum req_op {
+    REQ_STAT,
+    REQ_READ,
+    REQ_READDIR,
+    REQ_CREATE,
+    REQ_CP,
+    REQ_MV,
+    REQ_RM,
+    REQ_APPEND,
+    REQ_FORMAT,
+    REQ_OPS
+};
+
+// status of a request that could not be decoded
+#define PROTO_EBADREQ -100
+// status of a REQ_FORMAT sent while other requests were running
+#define PROTO_EBUSY -101
+
+// frames larger than this close the connection
+#define PROTO_MAX_FRAME (16 * 1024 * 1024)
+
+#define FSD_SOCKET "fs.sock"
+
+inline void
+put_u8(std::string &b, uint8_t v)
+{
+    b.push_back(static_cast<char>(v));
+}
+
+inline void
+put_u16(std::string &b, uint16_t v)
+{
+    put_u8(b, v);
+    put_u8(b, v >> 8);
+}
+
+inline void
+put_u32(std::string &b, uint32_t v)
+{
+    put_u16(b, v);
+    put_u16(b, v >> 16);
+}
+
+inline void
+put_str(std::string &b, const char *s, size_t len)
+{
+    put_u16(b, static_cast<uint16_t>(len));
+    b.append(s, len);
+}
+
+inline uint32_t
+get_u32(const char *p)
+{
+    const uint8_t *u = reinterpret_cast<const uint8_t*>(p);
+    return u[0] | (u[1] << 8) | (u[2] << 16) | ((uint32_t)u[3] << 24);
+}
+
+// starts a frame in <b>, finish_frame() fills in the length
+inline size_t
+begin_frame(std::string &b, uint32_t id)
+{
+    size_t start = b.size();
+    put_u32(b, 0);
+    put_u32(b, id);
+    return start;
+}
+
+inline void
+finish_frame(std::string &b, size_t start)
+{
+    uint32_t len = b.size() - start - 4;
+    for (int i = 0; i < 4; i++) {
+        b[start + i] = static_cast<char>(len >> (8 * i));
+    }
+}
+
+// Decodes the fields of a frame in order. A read past the end sets <ok> to
+// false and returns zeros, so a whole request can be decoded before the
+// single check.
+struct FrameReader {
+    const char *p;
+    const char *end;
+    bool ok;
+
+    FrameReader(const char *p, size_t len) : p(p), end(p + len), ok(true) {}
+
+    bool take(size_t n)
+    {
+        if (!ok || (size_t)(end - p) < n) {
+            ok = false;
+            return false;
+        }
+        return true;
+    }
+    uint8_t u8()
+    {
+        if (!take(1)) return 0;
+        return static_cast<uint8_t>(*p++);
+    }
+    uint16_t u16()
+    {
+        uint16_t lo = u8();
+        return lo | (u8() << 8);
+    }
+    uint32_t u32()
+    {
+        if (!take(4)) return 0;
+        uint32_t v = get_u32(p);
+        p += 4;
+        return v;
+    }
+    // the next <n> bytes, pointing into the frame
+    const char *bytes(size_t n)
+    {
+        if (!take(n)) return nullptr;
+        const char *s = p;
+        p += n;
+        return s;
+    }
+    std::string str()
+    {
+        uint16_t n = u16();
+        const char *s = bytes(n);
+        return s ? std::string(s, n) : std::string();
+    }
+};
+
+#endif // __PROTO_H__
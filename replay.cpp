@@ -0,0 +1,201 @@
+// Replays a workload trace against a freshly formatted image and reports
+// throughput and latency per operation.
+//
+// Usage: replay [-t threads] [-timing] [-i image] <tracefile>
+//
+// The trace is either a binary trace written by the shell's record command
+// or a command script in the format of test_commands.txt. With -timing the
+// original gaps between calls are kept, otherwise calls run back to back.
+// With -t N, N copies of the trace run in parallel, each on its own file
+// names; format calls are then skipped. The trace runs on a scratch image
+// that is removed afterwards unless -i names one to format and keep.
+#include <iostream>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include "fs.h"
+#include "trace.h"
+
+// stream buffer that throws away everything written to it
+class NullBuffer : public std::streambuf {
+protected:
+    int overflow(int c) { return c; }
+    std::streamsize xsputn(const char *, std::streamsize n) { return n; }
+};
+
+typedef std::chrono::steady_clock clk;
+
+struct worker_result {
+    std::vector<double> latencies[OP_COUNT]; // microseconds per call
+    int errors;
+};
+
+static int
+replay_one(FS &fs, const trace_record &r, const std::string &prefix)
+{
+    std::string a1 = r.arg1.empty() ? r.arg1 : prefix + r.arg1;
+    std::string a2 = r.arg2.empty() ? r.arg2 : prefix + r.arg2;
+    switch (r.op) {
+    case OP_FORMAT: return prefix.empty() ? fs.format() : 0;
+    case OP_CREATE:
+        if (r.data.size() == r.size) {
+            return fs.create(a1, r.data.data(), r.size);
+        } else {
+            std::string data(r.size, 'x');
+            return fs.create(a1, data.data(), r.size);
+        }
+    case OP_CAT: return fs.cat(a1);
+    case OP_LS: return fs.ls();
+    case OP_CP: return fs.cp(a1, a2);
+    case OP_MV: return fs.mv(a1, a2);
+    case OP_RM: return fs.rm(a1);
+    case OP_APPEND: return fs.append(a1, a2);
+    case OP_MKDIR: return fs.mkdir(a1);
+    case OP_CD: return fs.cd(a1);
+    case OP_PWD: return fs.pwd();
+    // chmod's first argument is the access rights, not a name
+    case OP_CHMOD: return fs.chmod(r.arg1, a2);
+    case OP_BEGIN: return prefix.empty() ? fs.begin() : 0;
+    case OP_COMMIT: return prefix.empty() ? fs.commit() : 0;
+    case OP_FALLOCATE: return fs.fallocate(a1, r.size);
+    // the second argument is the hint
+    case OP_ADVISE: return fs.advise(a1, parse_advice(r.arg2));
+    case OP_STAT: {
+        fs_stat st;
+        return fs.stat(a1.c_str(), st);
+    }
+    // the second argument is the offset
+    case OP_READ: {
+        std::vector<char> buf(r.size);
+        int ret = fs.read(a1.c_str(), buf.data(), r.size, std::strtoul(r.arg2.c_str(), nullptr, 10));
+        return ret < 0 ? ret : 0;
+    }
+    case OP_READDIR: {
+        DirView entries = fs.readdir();
+        return 0;
+    }
+    case OP_SYNC: return fs.sync();
+    }
+    return 0;
+}
+
+static void
+worker(FS &fs, const std::vector<trace_record> &records, std::string prefix,
+       bool timing, clk::time_point start, worker_result &res)
+{
+    res.errors = 0;
+    for (size_t i = 0; i < records.size(); i++) {
+        const trace_record &r = records[i];
+        if (timing) {
+            std::this_thread::sleep_until(start + std::chrono::microseconds(r.time_us));
+        }
+        clk::time_point t0 = clk::now();
+        if (replay_one(fs, r, prefix) != 0) {
+            res.errors++;
+        }
+        std::chrono::duration<double, std::micro> t = clk::now() - t0;
+        res.latencies[r.op].push_back(t.count());
+    }
+}
+
+static double
+percentile(std::vector<double> &v, double p)
+{
+    std::sort(v.begin(), v.end());
+    return v[(size_t)(p * (v.size() - 1) + 0.5)];
+}
+
+int
+main(int argc, char **argv)
+{
+    int threads = 1;
+    bool timing = false;
+    std::string path, image;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            threads = std::max(1, std::atoi(argv[++i]));
+        } else if (std::strcmp(argv[i], "-timing") == 0) {
+            timing = true;
+        } else if (std::strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            image = argv[++i];
+        } else {
+            path = argv[i];
+        }
+    }
+    if (path.empty()) {
+        std::cerr << "Usage: replay [-t threads] [-timing] [-i image] <tracefile>\n";
+        return 1;
+    }
+
+    std::vector<trace_record> records;
+    if (read_trace(path, records) != 0) {
+        std::cerr << "replay: cannot read trace " << path << "\n";
+        return 1;
+    }
+
+    bool scratch = image.empty();
+    if (scratch && (image = scratch_image()).empty()) {
+        std::cerr << "replay: cannot create a scratch image\n";
+        return 1;
+    }
+    FS fs(false, image.c_str());
+    if (scratch) {
+        // the open descriptor keeps the image alive until fs goes away
+        std::remove(image.c_str());
+    }
+    fs.format();
+    NullBuffer null;
+    std::streambuf *out = std::cout.rdbuf();
+    std::cout.rdbuf(&null);
+
+    std::vector<worker_result> results(threads);
+    std::vector<std::thread> pool;
+    clk::time_point start = clk::now();
+    if (threads == 1) {
+        worker(fs, records, "", timing, start, results[0]);
+    } else {
+        for (int t = 0; t < threads; t++) {
+            pool.push_back(std::thread(worker, std::ref(fs), std::cref(records),
+                                       "t" + std::to_string(t) + "_", timing,
+                                       start, std::ref(results[t])));
+        }
+        for (size_t t = 0; t < pool.size(); t++) {
+            pool[t].join();
+        }
+    }
+    std::chrono::duration<double> elapsed = clk::now() - start;
+    std::cout.rdbuf(out);
+
+    size_t total = 0;
+    int errors = 0;
+    std::vector<double> all[OP_COUNT];
+    for (int t = 0; t < threads; t++) {
+        errors += results[t].errors;
+        for (int op = 0; op < OP_COUNT; op++) {
+            all[op].insert(all[op].end(), results[t].latencies[op].begin(),
+                           results[t].latencies[op].end());
+            total += results[t].latencies[op].size();
+        }
+    }
+
+    std::cout << "calls " << total << ", errors " << errors << ", threads "
+              << threads << ", " << elapsed.count() << " s, "
+              << total / elapsed.count() << " calls/s\n";
+    std::cout << "op,calls,p50_us,p99_us,max_us\n";
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (all[op].empty()) {
+            continue;
+        }
+        std::cout << trace_op_names[op] << "," << all[op].size() << ","
+                  << percentile(all[op], 0.50) << ","
+                  << percentile(all[op], 0.99) << ","
+                  << all[op].back() << "\n";
+    }
+    return 0;
+}
@@ -0,0 +1,425 @@
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include "server.h"
+#include "proto.h"
+
+#define MAX_EVENTS 64
+
+Server::Server(FS &fs, int workers) : fs(fs), nworkers(workers), listen_fd(-1),
+    epoll_fd(-1), stopping(false), running(0), formatting(false)
+{
+}
+
+Server::~Server()
+{
+    if (listen_fd != -1) {
+        ::close(listen_fd);
+        ::unlink(path.c_str());
+    }
+    if (epoll_fd != -1) {
+        ::close(epoll_fd);
+    }
+}
+
+int
+Server::listen(const char *sock_path)
+{
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (std::strlen(sock_path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    std::strcpy(addr.sun_path, sock_path);
+
+    // a socket left behind by an earlier run is replaced, anything else is not
+    struct stat st;
+    if (::stat(sock_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        ::unlink(sock_path);
+    }
+
+    listen_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1) {
+        return -1;
+    }
+    if (::bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+        ::listen(listen_fd, SOMAXCONN) != 0) {
+        ::close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+    path = sock_path;
+
+    epoll_fd = ::epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        return -1;
+    }
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = listen_fd;
+    return ::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+}
+
+int
+Server::run()
+{
+    // the signals are blocked before the workers start so only the
+    // signalfd sees them
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+    int sig_fd = ::signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sig_fd == -1) {
+        return -1;
+    }
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = sig_fd;
+    ::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sig_fd, &ev);
+
+    for (int i = 0; i < nworkers; i++) {
+        workers.push_back(std::thread(&Server::worker, this));
+    }
+
+    bool done = false;
+    epoll_event events[MAX_EVENTS];
+    while (!done) {
+        int n = ::epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == listen_fd) {
+                accept_all();
+                continue;
+            }
+            if (fd == sig_fd) {
+                done = true;
+                continue;
+            }
+            std::map<int, std::shared_ptr<Conn> >::iterator it = conns.find(fd);
+            if (it == conns.end()) {
+                continue;
+            }
+            std::shared_ptr<Conn> c = it->second;
+            if (events[i].events & EPOLLOUT) {
+                std::lock_guard<std::mutex> guard(c->lock);
+                flush(*c);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR | EPOLLRDHUP)) {
+                read_conn(c);
+            }
+        }
+    }
+
+    // the workers finish the requests already queued
+    {
+        std::lock_guard<std::mutex> guard(queue_lock);
+        stopping = true;
+    }
+    queue_cond.notify_all();
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+    workers.clear();
+    while (!conns.empty()) {
+        close_conn(conns.begin()->second);
+    }
+    ::close(sig_fd);
+    return 0;
+}
+
+void
+Server::accept_all()
+{
+    while (true) {
+        int fd = ::accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            // EAGAIN once the backlog is empty
+            return;
+        }
+        std::shared_ptr<Conn> c(new Conn);
+        c->fd = fd;
+        c->queued = false;
+        c->closed = false;
+        conns[fd] = c;
+
+        // edge triggered: reads run until EAGAIN, and a send that hit
+        // EAGAIN is resumed on the next EPOLLOUT edge
+        epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = fd;
+        ::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+// reads everything available and queues the complete frames. The
+// connection is closed on EOF, clients keep it open until they have
+// their responses.
+void
+Server::read_conn(const std::shared_ptr<Conn> &c)
+{
+    char buf[65536];
+    while (true) {
+        ssize_t n = ::read(c->fd, buf, sizeof(buf));
+        if (n > 0) {
+            c->in.append(buf, n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        close_conn(c);
+        return;
+    }
+
+    std::vector<std::string> frames;
+    size_t pos = 0;
+    while (c->in.size() - pos >= 4) {
+        uint32_t len = get_u32(c->in.data() + pos);
+        if (len < 5 || len > PROTO_MAX_FRAME) {
+            close_conn(c);
+            return;
+        }
+        if (c->in.size() - pos - 4 < len) {
+            break;
+        }
+        frames.push_back(c->in.substr(pos + 4, len));
+        pos += 4 + len;
+    }
+    c->in.erase(0, pos);
+    if (frames.empty()) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(queue_lock);
+    for (size_t i = 0; i < frames.size(); i++) {
+        c->pending.push_back(std::move(frames[i]));
+    }
+    if (!c->queued) {
+        c->queued = true;
+        ready.push_back(c);
+        queue_cond.notify_one();
+    }
+}
+
+void
+Server::close_conn(const std::shared_ptr<Conn> &c)
+{
+    int fd = c->fd;
+    ::epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    {
+        // workers check <closed> before they touch the socket
+        std::lock_guard<std::mutex> guard(c->lock);
+        c->closed = true;
+        ::close(fd);
+    }
+    conns.erase(fd);
+}
+
+// A worker takes a connection off the ready queue with all its pending
+// frames, executes them in order and sends the responses in one go. The
+// connection is queued again if more frames arrived meanwhile.
+void
+Server::worker()
+{
+    while (true) {
+        std::shared_ptr<Conn> c;
+        std::deque<std::string> batch;
+        {
+            std::unique_lock<std::mutex> lock(queue_lock);
+            while (!stopping && ready.empty()) {
+                queue_cond.wait(lock);
+            }
+            if (ready.empty()) {
+                return;
+            }
+            c = ready.front();
+            ready.pop_front();
+            batch.swap(c->pending);
+        }
+
+        std::string out;
+        for (size_t i = 0; i < batch.size(); i++) {
+            handle(batch[i], out);
+        }
+        {
+            std::lock_guard<std::mutex> guard(c->lock);
+            if (!c->closed) {
+                c->out += out;
+                flush(*c);
+            }
+        }
+
+        std::lock_guard<std::mutex> guard(queue_lock);
+        if (c->pending.empty()) {
+            c->queued = false;
+        } else {
+            ready.push_back(c);
+            queue_cond.notify_one();
+        }
+    }
+}
+
+void
+Server::flush(Conn &c)
+{
+    size_t sent = 0;
+    while (sent < c.out.size()) {
+        ssize_t n = ::send(c.fd, c.out.data() + sent, c.out.size() - sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            sent += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        // EAGAIN waits for EPOLLOUT, errors are seen by the loop as EPOLLERR
+        break;
+    }
+    c.out.erase(0, sent);
+}
+
+void
+Server::handle(const std::string &frame, std::string &out)
+{
+    FrameReader r(frame.data(), frame.size());
+    uint32_t id = r.u32();
+    uint8_t op = r.u8();
+
+    size_t start = begin_frame(out, id);
+    size_t status_at = out.size();
+    put_u32(out, 0);
+    int32_t status = PROTO_EBADREQ;
+    bool admitted = enter(op);
+    if (!admitted) {
+        status = PROTO_EBUSY;
+        op = REQ_OPS;
+    }
+
+    switch (op) {
+    case REQ_STAT: {
+        std::string name = r.str();
+        if (!r.ok) break;
+        fs_stat st;
+        status = fs.stat(name.c_str(), st);
+        if (status == 0) {
+            put_u32(out, st.size);
+            put_u16(out, st.first_blk);
+            put_u8(out, st.type);
+            put_u8(out, st.access_rights);
+        }
+        break;
+    }
+    case REQ_READ: {
+        std::string name = r.str();
+        uint32_t offset = r.u32();
+        uint32_t len = r.u32();
+        if (!r.ok) break;
+        // the buffer is sized by the file, not by the request
+        fs_stat st;
+        status = fs.stat(name.c_str(), st);
+        if (status != 0) break;
+        uint32_t avail = offset < st.size ? st.size - offset : 0;
+        if (len > avail) len = avail;
+        size_t at = out.size();
+        out.resize(at + len);
+        status = len ? fs.read(name.c_str(), &out[at], len, offset) : 0;
+        out.resize(at + (status > 0 ? status : 0));
+        break;
+    }
+    case REQ_READDIR: {
+        status = 0;
+        for (const dir_entry &e : fs.readdir()) {
+            put_str(out, e.file_name, strnlen(e.file_name, sizeof(e.file_name)));
+            put_u32(out, e.size);
+            put_u8(out, e.type & TYPE_MASK);
+            put_u8(out, e.access_rights);
+            status++;
+        }
+        break;
+    }
+    case REQ_CREATE: {
+        std::string name = r.str();
+        uint32_t size = r.u32();
+        const char *data = r.bytes(size);
+        if (!r.ok) break;
+        status = fs.create(name, data, size);
+        break;
+    }
+    case REQ_CP:
+    case REQ_MV:
+    case REQ_APPEND: {
+        std::string a = r.str();
+        std::string b = r.str();
+        if (!r.ok) break;
+        if (op == REQ_CP) status = fs.cp(a, b);
+        else if (op == REQ_MV) status = fs.mv(a, b);
+        else status = fs.append(a, b);
+        break;
+    }
+    case REQ_RM: {
+        std::string name = r.str();
+        if (!r.ok) break;
+        status = fs.rm(name);
+        break;
+    }
+    case REQ_FORMAT:
+        status = fs.format();
+        break;
+    }
+    if (admitted) {
+        leave(op);
+    }
+
+    if (!r.ok) {
+        out.resize(status_at + 4);
+        status = PROTO_EBADREQ;
+    }
+    for (int i = 0; i < 4; i++) {
+        out[status_at + i] = static_cast<char>((uint32_t)status >> (8 * i));
+    }
+    finish_frame(out, start);
+}
+
+// A format would pull the blocks out from under requests in flight, so it
+// is refused while any run, and the requests that arrive during one wait
+bool
+Server::enter(uint8_t op)
+{
+    std::unique_lock<std::mutex> lock(ops_lock);
+    while (formatting) {
+        ops_cond.wait(lock);
+    }
+    if (op == REQ_FORMAT) {
+        if (running > 0) {
+            return false;
+        }
+        formatting = true;
+        return true;
+    }
+    running++;
+    return true;
+}
+
+void
+Server::leave(uint8_t op)
+{
+    std::lock_guard<std::mutex> lock(ops_lock);
+    if (op == REQ_FORMAT) {
+        formatting = false;
+        ops_cond.notify_all();
+    } else {
+        running--;
+    }
+}
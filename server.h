@@ -0,0 +1,74 @@
+#include <string>
+#include <deque>
+#include <map>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "fs.h"
+
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+// Serves one mounted FS to local clients over a Unix domain socket, using
+// the protocol in proto.h. An epoll loop accepts connections and splits
+// their input into frames; a pool of workers executes them. The requests
+// of one connection run in order on one worker at a time, so clients can
+// pipeline them, while different connections run in parallel.
+class Server {
+public:
+    Server(FS &fs, int workers);
+    ~Server();
+    // binds and listens on <path>, returns -1 on error
+    int listen(const char *path);
+    // runs the event loop until SIGINT or SIGTERM
+    int run();
+
+private:
+    struct Conn {
+        int fd;
+        // input not yet split into frames, touched by the loop only
+        std::string in;
+        // frames waiting for a worker, and whether the connection is in
+        // the ready queue; both guarded by Server::queue_lock
+        std::deque<std::string> pending;
+        bool queued;
+        // guards out, closed and the socket itself
+        std::mutex lock;
+        std::string out;
+        bool closed;
+    };
+
+    FS &fs;
+    int nworkers;
+    int listen_fd;
+    int epoll_fd;
+    std::string path;
+    std::map<int, std::shared_ptr<Conn> > conns;
+    std::vector<std::thread> workers;
+    std::mutex queue_lock;
+    std::condition_variable queue_cond;
+    std::deque<std::shared_ptr<Conn> > ready;
+    bool stopping;
+    // requests being executed, and whether one of them is a format, which
+    // runs alone
+    std::mutex ops_lock;
+    std::condition_variable ops_cond;
+    int running;
+    bool formatting;
+
+    void accept_all();
+    void read_conn(const std::shared_ptr<Conn> &c);
+    void close_conn(const std::shared_ptr<Conn> &c);
+    void worker();
+    // executes one request frame and appends the response to <out>
+    void handle(const std::string &frame, std::string &out);
+    // admits a request of <op>, false for a format that has to wait
+    bool enter(uint8_t op);
+    void leave(uint8_t op);
+    // sends what it can of c->out, c->lock must be held
+    void flush(Conn &c);
+};
+
+#endif // __SERVER_H__
@@ -1,26 +1,42 @@
 #include <iostream>
-#include <sstream>
+#include <fstream>
 #include <string>
 #include <vector>
+#include <chrono>
+#include <ctime>
+#include <cstdlib>
+#include <thread>
+#include <unistd.h>
 #include "shell.h"
 #include "fs.h"
+#include "span.h"
 
 std::string commands_str[] = {
-    "format", "create", "cat", "ls",
-    "cp", "mv", "rm", "append",
+    "format", "create", "cat", "ls", "stat",
+    "cp", "mv", "rm", "append", "fallocate", "advise",
     "mkdir", "cd", "pwd",
     "chmod",
-    "help", "quit"
+    "begin", "commit", "batch",
+    "sync", "delalloc", "compression", "dedup", "writeback", "scrub",
+    "record", "stats", "spans", "time", "flush", "help", "quit"
 };
 
-Shell::Shell()
+#define HELP_TEXT "format, create, cat, ls, stat, cp, mv, rm, append, fallocate, advise, mkdir, cd, pwd, chmod, begin, commit, batch, sync, delalloc, compression, dedup, writeback, scrub, record, stats, spans, time, flush, help, quit\n"
+
+// the shell is quiet when stdin is not a terminal, e.g. a script on a pipe
+Shell::Shell() : filesystem(isatty(0)), interactive(isatty(0))
 {
-    std::cout << "Starting shell...\n";
+    if (interactive)
+        std::cout << "Starting shell...\n";
 }
 
 Shell::~Shell()
 {
-    std::cout << "Exiting shell...\n";
+    // write out a span trace that was never stopped
+    SpanTracer::stop();
+    if (interactive)
+        std::cout << "Exiting shell...\n";
+    std::cout.flush();
 }
 
 void
@@ -28,225 +44,549 @@ Shell::run()
 {
     bool running = true;
     std::string line;
-    std::string str;
-    char c;
     std::vector<std::string> cmd_line;
+    while (running) {
+        if (interactive)
+            std::cout << "filesystem> ";
+        if (!std::getline(std::cin, line))
+            break;
+        tokenize(line, cmd_line);
+        running = execute(cmd_line);
+    }
+}
+
+// splits a command line into words, multiple blanks are skipped. The words
+// are assigned in place so their buffers are reused from line to line.
+void
+Shell::tokenize(const std::string &line, std::vector<std::string> &cmd_line)
+{
+    const char *p = line.data();
+    const char *end = p + line.size();
+    size_t n = 0;
+    while (p < end) {
+        // strip multiple blanks
+        while (p < end && *p == ' ')
+            p++;
+        const char *word = p;
+        while (p < end && *p != ' ')
+            p++;
+        if (p == word)
+            break;
+        if (n == cmd_line.size())
+            cmd_line.push_back(std::string());
+        cmd_line[n++].assign(word, p - word);
+    }
+    cmd_line.resize(n);
+
+    if (DEBUG) {
+        std::cout << "Line: " << line << "\n";
+        for (unsigned i = 0; i < cmd_line.size(); ++i)
+            std::cout << "cmd/arg: " << cmd_line[i] << "\n";
+    }
+}
+
+// runs one command, returns false when the shell should exit
+bool
+Shell::execute(const std::vector<std::string> &cmd_line)
+{
     std::string cmd, arg1, arg2;
     int ret_val = 0;
-    while (running) {
-        std::cout << "filesystem> ";
-        std::getline(std::cin, line);
-        std::stringstream linestream(line);
-        cmd_line.clear();
-        str.clear();
-        while (linestream.get(c)) {
-            //std::cout << "parsing cmd line: " << c << "\n";
-            if (c != ' ') {
-                str += c;
-            } else {
-                // strip multiple blanks
-                if (!str.empty()) {
-                    cmd_line.push_back(str);
-                    str.clear();
-                }
-            }
-        }
-        if (!str.empty())
-            cmd_line.push_back(str);
-        if (line.empty())
-            cmd = "";
-        else
-            cmd = cmd_line[0];
+    if (cmd_line.empty())
+        cmd = "";
+    else
+        cmd = cmd_line[0];
 
-        if (DEBUG) {
-            std::cout << "Line: " << line << std::endl;
-            std::cout << "cmd: " << cmd << std::endl;
-            for (unsigned i = 0; i < cmd_line.size(); ++i)
-                std::cout << "cmd/arg: " << cmd_line[i] << "\n";
+    if (cmd == "time") {
+        if (cmd_line.size() < 2) {
+            std::cout << "Usage: time <command> [args]\n";
+            return true;
         }
+        return time_command(cmd_line);
+    }
 
-        if (cmd == "format") {
-            if (cmd_line.size() != 1) {
-                std::cout << "Usage: format\n";
-                continue;
-            }
-            // check return value so everything is ok
-            ret_val = filesystem.format();
-            if (ret_val) {
-                std::cout << "Error: format failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "format") {
+        if (cmd_line.size() != 1) {
+            std::cout << "Usage: format\n";
+            return true;
         }
+        // check return value so everything is ok
+        ret_val = filesystem.format();
+        if (ret_val) {
+            std::cout << "Error: format failed, error code " << ret_val << "\n";
+        }
+    }
 
-        else if (cmd == "create") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: create <file>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
+    else if (cmd == "create") {
+        if (cmd_line.size() != 2) {
+            std::cout << "Usage: create <file>\n";
+            return true;
+        }
+        arg1 = cmd_line[1];
+        if (interactive)
             std::cout << "Enter data. Empty line to end.\n";
-            // check return value so everything is ok
-            ret_val = filesystem.create(arg1);
-            if (ret_val) {
-                std::cout << "Error: create " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+        // check return value so everything is ok
+        ret_val = filesystem.create(arg1);
+        if (ret_val) {
+            std::cout << "Error: create " << arg1;
+            std::cout << " failed, error code " << ret_val << "\n";
         }
+    }
 
-        else if (cmd == "cat") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: cat <file>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            // check return value so everything is ok
-            ret_val = filesystem.cat(arg1);
-            if (ret_val) {
-                std::cout << "Error: cat " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "cat") {
+        if (cmd_line.size() != 2) {
+            std::cout << "Usage: cat <file>\n";
+            return true;
+        }
+        arg1 = cmd_line[1];
+        // check return value so everything is ok
+        ret_val = filesystem.cat(arg1);
+        if (ret_val) {
+            std::cout << "Error: cat " << arg1;
+            std::cout << " failed, error code " << ret_val << "\n";
         }
+    }
 
-        else if (cmd == "ls") {
-            if (cmd_line.size() != 1) {
-                std::cout << "Usage: ls\n";
-                continue;
-            }
-            // check return value so everything is ok
-            ret_val = filesystem.ls();
-            if (ret_val) {
-                std::cout << "Error: ls failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "ls") {
+        if (cmd_line.size() != 1) {
+            std::cout << "Usage: ls\n";
+            return true;
         }
+        // check return value so everything is ok
+        ret_val = filesystem.ls();
+        if (ret_val) {
+            std::cout << "Error: ls failed, error code " << ret_val << "\n";
+        }
+    }
 
-        else if (cmd == "cp") {
-            if (cmd_line.size() != 3) {
-                std::cout << "Usage: <oldfile> <newfile>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            arg2 = cmd_line[2];
-            // check return value so everything is ok
-            ret_val = filesystem.cp(arg1, arg2);
-            if (ret_val) {
-                std::cout << "Error: cp " << arg1 << " " << arg2;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "stat") {
+        if (cmd_line.size() != 2) {
+            std::cout << "Usage: stat <file>\n";
+            return true;
         }
+        arg1 = cmd_line[1];
+        // sparse and preallocated files differ in size and allocation
+        fs_stat st;
+        ret_val = filesystem.stat(arg1.c_str(), st);
+        if (ret_val) {
+            std::cout << "Error: stat " << arg1;
+            std::cout << " failed, error code " << ret_val << "\n";
+        } else {
+            std::cout << arg1 << " size " << st.size << ", allocated " << st.allocated
+                      << (st.compressed ? ", compressed" : "") << "\n";
+        }
+    }
 
-        else if (cmd == "mv") {
-            if (cmd_line.size() != 3) {
-                std::cout << "Usage: mv <sourcepath> <destpath>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            arg2 = cmd_line[2];
-            // check return value so everything is ok
-            ret_val = filesystem.mv(arg1, arg2);
-            if (ret_val) {
-                std::cout << "Error: mv " << arg1 << " " << arg2;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "cp") {
+        if (cmd_line.size() != 3) {
+            std::cout << "Usage: <oldfile> <newfile>\n";
+            return true;
+        }
+        arg1 = cmd_line[1];
+        arg2 = cmd_line[2];
+        // check return value so everything is ok
+        ret_val = filesystem.cp(arg1, arg2);
+        if (ret_val) {
+            std::cout << "Error: cp " << arg1 << " " << arg2;
+            std::cout << " failed, error code " << ret_val << "\n";
         }
+    }
 
-        else if (cmd == "rm") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: rm <file>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            // check return value so everything is ok
-            ret_val = filesystem.rm(arg1);
-            if (ret_val) {
-                std::cout << "Error: rm " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "mv") {
+        if (cmd_line.size() != 3) {
+            std::cout << "Usage: mv <sourcepath> <destpath>\n";
+            return true;
+        }
+        arg1 = cmd_line[1];
+        arg2 = cmd_line[2];
+        // check return value so everything is ok
+        ret_val = filesystem.mv(arg1, arg2);
+        if (ret_val) {
+            std::cout << "Error: mv " << arg1 << " " << arg2;
+            std::cout << " failed, error code " << ret_val << "\n";
         }
+    }
 
-        else if (cmd == "append") {
-            if (cmd_line.size() != 3) {
-                std::cout << "Usage: append <filepath1> <filepath2>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            arg2 = cmd_line[2];
-            // check return value so everything is ok
-            ret_val = filesystem.append(arg1, arg2);
-            if (ret_val) {
-                std::cout << "Error: append " << arg1 << " " << arg2;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "rm") {
+        if (cmd_line.size() != 2) {
+            std::cout << "Usage: rm <file>\n";
+            return true;
+        }
+        arg1 = cmd_line[1];
+        // check return value so everything is ok
+        ret_val = filesystem.rm(arg1);
+        if (ret_val) {
+            std::cout << "Error: rm " << arg1;
+            std::cout << " failed, error code " << ret_val << "\n";
         }
+    }
 
-        else if (cmd == "mkdir") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: mkdir <dirpath>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            // check return value so everything is ok
-            ret_val = filesystem.mkdir(arg1);
-            if (ret_val) {
-                std::cout << "Error: mkdir " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "append") {
+        if (cmd_line.size() != 3) {
+            std::cout << "Usage: append <filepath1> <filepath2>\n";
+            return true;
         }
+        arg1 = cmd_line[1];
+        arg2 = cmd_line[2];
+        // check return value so everything is ok
+        ret_val = filesystem.append(arg1, arg2);
+        if (ret_val) {
+            std::cout << "Error: append " << arg1 << " " << arg2;
+            std::cout << " failed, error code " << ret_val << "\n";
+        }
+    }
 
-        else if (cmd == "cd") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: cd <dirpath>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            // check return value so everything is ok
-            ret_val = filesystem.cd(arg1);
-            if (ret_val) {
-                std::cout << "Error: cd " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "fallocate") {
+        if (cmd_line.size() != 3 ||
+            cmd_line[2].find_first_not_of("0123456789") != std::string::npos) {
+            std::cout << "Usage: fallocate <filepath> <bytes>\n";
+            return true;
         }
+        arg1 = cmd_line[1];
+        arg2 = cmd_line[2];
+        // check return value so everything is ok
+        ret_val = filesystem.fallocate(arg1, std::strtoul(arg2.c_str(), nullptr, 10));
+        if (ret_val == -6) {
+            std::cout << "Error: fallocate " << arg1 << ": compressed files cannot be preallocated\n";
+        } else if (ret_val) {
+            std::cout << "Error: fallocate " << arg1 << " " << arg2;
+            std::cout << " failed, error code " << ret_val << "\n";
+        }
+    }
 
-        else if (cmd == "pwd") {
-            if (cmd_line.size() != 1) {
-                std::cout << "Usage: pwd\n";
-                continue;
-            }
-            // check return value so everything is ok
-            ret_val = filesystem.pwd();
-            if (ret_val) {
-                std::cout << "Error: pwd failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "advise") {
+        if (cmd_line.size() != 3 || parse_advice(cmd_line[2]) == -1) {
+            std::cout << "Usage: advise <filepath> normal|sequential|random|willneed|dontneed\n";
+            return true;
+        }
+        arg1 = cmd_line[1];
+        arg2 = cmd_line[2];
+        // check return value so everything is ok
+        ret_val = filesystem.advise(arg1, parse_advice(arg2));
+        if (ret_val) {
+            std::cout << "Error: advise " << arg1 << " " << arg2;
+            std::cout << " failed, error code " << ret_val << "\n";
+        }
+    }
+
+    else if (cmd == "mkdir") {
+        if (cmd_line.size() != 2) {
+            std::cout << "Usage: mkdir <dirpath>\n";
+            return true;
+        }
+        arg1 = cmd_line[1];
+        // check return value so everything is ok
+        ret_val = filesystem.mkdir(arg1);
+        if (ret_val) {
+            std::cout << "Error: mkdir " << arg1;
+            std::cout << " failed, error code " << ret_val << "\n";
+        }
+    }
+
+    else if (cmd == "cd") {
+        if (cmd_line.size() != 2) {
+            std::cout << "Usage: cd <dirpath>\n";
+            return true;
+        }
+        arg1 = cmd_line[1];
+        // check return value so everything is ok
+        ret_val = filesystem.cd(arg1);
+        if (ret_val) {
+            std::cout << "Error: cd " << arg1;
+            std::cout << " failed, error code " << ret_val << "\n";
+        }
+    }
+
+    else if (cmd == "pwd") {
+        if (cmd_line.size() != 1) {
+            std::cout << "Usage: pwd\n";
+            return true;
+        }
+        // check return value so everything is ok
+        ret_val = filesystem.pwd();
+        if (ret_val) {
+            std::cout << "Error: pwd failed, error code " << ret_val << "\n";
+        }
+    }
+
+    else if (cmd == "chmod") {
+        if (cmd_line.size() != 3) {
+            std::cout << "Usage: chmod <accessrights> <filepath>\n";
+            return true;
+        }
+        arg1 = cmd_line[1];
+        arg2 = cmd_line[2];
+        // check return value so everything is ok
+        ret_val = filesystem.chmod(arg1, arg2);
+        if (ret_val) {
+            std::cout << "Error: chmod " << arg1 << " " << arg2;
+            std::cout << " failed, error code " << ret_val << "\n";
+        }
+    }
+
+    else if (cmd == "begin") {
+        if (cmd_line.size() != 1) {
+            std::cout << "Usage: begin\n";
+            return true;
+        }
+        // check return value so everything is ok
+        ret_val = filesystem.begin();
+        if (ret_val) {
+            std::cout << "Error: begin failed, error code " << ret_val << "\n";
+        }
+    }
+
+    else if (cmd == "commit") {
+        if (cmd_line.size() != 1) {
+            std::cout << "Usage: commit\n";
+            return true;
         }
+        // check return value so everything is ok
+        ret_val = filesystem.commit();
+        if (ret_val) {
+            std::cout << "Error: commit failed, error code " << ret_val << "\n";
+        }
+    }
+
+    else if (cmd == "sync") {
+        if (cmd_line.size() != 1) {
+            std::cout << "Usage: sync\n";
+            return true;
+        }
+        // check return value so everything is ok
+        ret_val = filesystem.sync();
+        if (ret_val) {
+            std::cout << "Error: sync failed, error code " << ret_val << "\n";
+        }
+    }
+
+    else if (cmd == "delalloc") {
+        if (cmd_line.size() != 2 || (cmd_line[1] != "on" && cmd_line[1] != "off")) {
+            std::cout << "Usage: delalloc on|off\n";
+            return true;
+        }
+        filesystem.set_delayed(cmd_line[1] == "on");
+    }
 
-        else if (cmd == "chmod") {
-            if (cmd_line.size() != 3) {
-                std::cout << "Usage: chmod <accessrights> <filepath>\n";
-                continue;
+    else if (cmd == "compression") {
+        if (cmd_line.size() != 2 || (cmd_line[1] != "on" && cmd_line[1] != "off")) {
+            std::cout << "Usage: compression on|off\n";
+            return true;
+        }
+        filesystem.set_compression(cmd_line[1] == "on");
+    }
+
+    else if (cmd == "dedup") {
+        if (cmd_line.size() != 2 || (cmd_line[1] != "on" && cmd_line[1] != "off")) {
+            std::cout << "Usage: dedup on|off\n";
+            return true;
+        }
+        filesystem.set_dedup(cmd_line[1] == "on");
+    }
+
+    else if (cmd == "writeback") {
+        if (cmd_line.size() != 2 || (cmd_line[1] != "on" && cmd_line[1] != "off")) {
+            std::cout << "Usage: writeback on|off\n";
+            return true;
+        }
+        filesystem.set_writeback(cmd_line[1] == "on");
+    }
+
+    else if (cmd == "scrub") {
+        if (cmd_line.size() == 2 && cmd_line[1] == "status") {
+            std::vector<int> bad;
+            ret_val = filesystem.scrub_status(bad);
+            if (ret_val == 1) {
+                std::cout << "scrub running\n";
+                return true;
             }
-            arg1 = cmd_line[1];
-            arg2 = cmd_line[2];
-            // check return value so everything is ok
-            ret_val = filesystem.chmod(arg1, arg2);
-            if (ret_val) {
-                std::cout << "Error: chmod " << arg1 << " " << arg2;
-                std::cout << " failed, error code " << ret_val << std::endl;
+            if (ret_val == -3) {
+                std::cout << "no scrub has run\n";
+                return true;
             }
+            if (ret_val < 0) {
+                std::cout << "Error: scrub failed, error code " << ret_val << "\n";
+                return true;
+            }
+            std::cout << "scrubbed " << ret_val << " blocks, " << bad.size() << " damaged\n";
+            for (size_t k = 0; k < bad.size(); k++) {
+                std::cout << "damaged block " << bad[k] << "\n";
+            }
+            return true;
+        }
+        if (cmd_line.size() > 2 ||
+            (cmd_line.size() == 2 &&
+             cmd_line[1].find_first_not_of("0123456789") != std::string::npos)) {
+            std::cout << "Usage: scrub [threads] | scrub status\n";
+            return true;
+        }
+        unsigned threads = std::thread::hardware_concurrency();
+        if (cmd_line.size() == 2) {
+            threads = std::strtoul(cmd_line[1].c_str(), nullptr, 10);
+        }
+        // runs in the background, scrub status reports the result
+        ret_val = filesystem.scrub_start(threads ? threads : 1);
+        if (ret_val == -2) {
+            std::cout << "Error: a scrub is already running\n";
+        } else if (ret_val < 0) {
+            std::cout << "Error: scrub failed, error code " << ret_val << "\n";
+        } else {
+            std::cout << "scrub started\n";
         }
+    }
 
-        else if (cmd == "quit")
-            running = false;
+    else if (cmd == "batch") {
+        if (cmd_line.size() != 2) {
+            std::cout << "Usage: batch <scriptfile>\n";
+            return true;
+        }
+        arg1 = cmd_line[1];
+        // check return value so everything is ok
+        ret_val = batch(arg1);
+        if (ret_val) {
+            std::cout << "Error: batch " << arg1;
+            std::cout << " failed, error code " << ret_val << "\n";
+        }
+    }
 
-        else if (cmd == "help") {
-            std::cout << "Available commands:\n";
-            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, help, quit\n";
+    else if (cmd == "record") {
+        if (cmd_line.size() != 2) {
+            std::cout << "Usage: record <tracefile> | record off\n";
+            return true;
         }
+        arg1 = cmd_line[1];
+        if (arg1 == "off") {
+            filesystem.set_recorder(nullptr);
+            recorder.close();
+            return true;
+        }
+        // check return value so everything is ok
+        ret_val = recorder.open(arg1);
+        if (ret_val) {
+            std::cout << "Error: record " << arg1;
+            std::cout << " failed, error code " << ret_val << "\n";
+        } else {
+            filesystem.set_recorder(&recorder);
+        }
+    }
 
-        else if (cmd == "") {
-            ; // do nothing
+    else if (cmd == "stats") {
+        if (cmd_line.size() == 2 && cmd_line[1] == "reset") {
+            filesystem.reset_stats();
+            return true;
         }
+        if (cmd_line.size() != 1) {
+            std::cout << "Usage: stats [reset]\n";
+            return true;
+        }
+        fs_stats s;
+        filesystem.stats(s);
+        print_stats(std::cout, s);
+    }
+
+    else if (cmd == "spans") {
+        if (cmd_line.size() != 2) {
+            std::cout << "Usage: spans <tracefile.json> | spans off\n";
+            return true;
+        }
+        arg1 = cmd_line[1];
+        // check return value so everything is ok
+        ret_val = (arg1 == "off") ? SpanTracer::stop() : SpanTracer::start(arg1);
+        if (ret_val) {
+            std::cout << "Error: spans " << arg1;
+            std::cout << " failed, error code " << ret_val << "\n";
+        }
+    }
+
+    else if (cmd == "flush") {
+        // output is only written when the buffer fills otherwise
+        std::cout.flush();
+    }
+
+    else if (cmd == "quit")
+        return false;
+
+    else if (cmd == "help") {
+        std::cout << "Available commands:\n";
+        std::cout << HELP_TEXT;
+    }
+
+    else if (cmd == "") {
+        ; // do nothing
+    }
+
+    else {
+        std::cout << "Available commands:\n";
+        std::cout << HELP_TEXT;
+    }
+    return true;
+}
+
+// time <command> runs <command> and reports its wall and CPU time, and the
+// block I/O, metadata flushes and allocator work it caused
+bool
+Shell::time_command(const std::vector<std::string> &cmd_line)
+{
+    std::vector<std::string> command(cmd_line.begin() + 1, cmd_line.end());
+    fs_stats before, after;
+    filesystem.stats(before);
+    std::clock_t cpu_start = std::clock();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    bool running = execute(command);
+
+    std::chrono::duration<double, std::milli> wall = std::chrono::steady_clock::now() - start;
+    double cpu = 1000.0 * (std::clock() - cpu_start) / CLOCKS_PER_SEC;
+    filesystem.stats(after);
+
+    uint64_t reads = 0, writes = 0;
+    for (int c = 0; c < BLK_CLASSES; c++) {
+        reads += after.reads[c] - before.reads[c];
+        writes += after.writes[c] - before.writes[c];
+    }
+    std::cout << "real " << wall.count() << " ms, cpu " << cpu << " ms\n";
+    std::cout << "block reads " << reads << ", writes " << writes
+              << ", flushes " << after.flushes - before.flushes
+              << ", FAT entries scanned " << after.alloc_scanned - before.alloc_scanned
+              << "\n";
+    return running;
+}
+
+// batch <scriptfile> runs the commands in <scriptfile> as one batch, the
+// FAT and the directory are written once when the script ends. Data for
+// create is read from the script as well, lines starting with // are skipped.
+int
+Shell::batch(std::string scriptfile)
+{
+    std::ifstream script(scriptfile.c_str());
+    if (!script.is_open()) {
+        return -1;
+    }
+    int ret_val = filesystem.begin();
+    if (ret_val) {
+        return -2;
+    }
 
-        else {
-            std::cout << "Available commands:\n";
-            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, help, quit\n";
+    std::streambuf *saved = std::cin.rdbuf(script.rdbuf());
+    std::string line;
+    std::vector<std::string> cmd_line;
+    while (std::getline(std::cin, line)) {
+        if (line.compare(0, 2, "//") == 0) {
+            continue;
         }
+        tokenize(line, cmd_line);
+        if (!cmd_line.empty() && (cmd_line[0] == "batch" ||
+            cmd_line[0] == "begin" || cmd_line[0] == "commit")) {
+            std::cout << "Error: " << cmd_line[0] << " is not allowed in a batch\n";
+            continue;
+        }
+        if (!execute(cmd_line)) {
+            break;
+        }
+    }
+    std::cin.rdbuf(saved);
+
+    if (filesystem.commit()) {
+        return -3;
     }
+    return 0;
 }
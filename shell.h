@@ -1,5 +1,8 @@
 #include <iostream>
+#include <string>
+#include <vector>
 #include "fs.h"
+#include "trace.h"
 
 #ifndef __SHELL_H__
 #define __SHELL_H__
@@ -7,6 +10,13 @@
 class Shell {
 private:
     FS filesystem;
+    // prompts and banners are only printed for an interactive shell
+    bool interactive;
+    TraceRecorder recorder;
+    void tokenize(const std::string &line, std::vector<std::string> &cmd_line);
+    bool execute(const std::vector<std::string> &cmd_line);
+    int batch(std::string scriptfile);
+    bool time_command(const std::vector<std::string> &cmd_line);
 public:
     Shell();
     ~Shell();
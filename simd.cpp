@@ -0,0 +1,419 @@
+#include <cstring>
+#include <atomic>
+#include "simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+const char *simd_level_names[SIMD_LEVELS] = { "scalar", "sse2", "avx2" };
+
+// scalar kernels, also used for the tails of the vector loops
+
+static int
+find_free_scalar(const int16_t *fat, unsigned from, unsigned to)
+{
+    for (unsigned i = from; i < to; i++) {
+        if (fat[i] == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int
+find_run_scalar(const int16_t *fat, unsigned from, unsigned to, unsigned len)
+{
+    unsigned run = 0;
+    for (unsigned i = from; i < to; i++) {
+        run = fat[i] == 0 ? run + 1 : 0;
+        if (run >= len) {
+            return i + 1 - len;
+        }
+    }
+    return -1;
+}
+
+static unsigned
+count_free_scalar(const int16_t *fat, unsigned from, unsigned to)
+{
+    unsigned n = 0;
+    for (unsigned i = from; i < to; i++) {
+        n += fat[i] == 0;
+    }
+    return n;
+}
+
+static int
+match_scalar(const char *names, unsigned stride, unsigned max, unsigned n,
+             const char *name, unsigned)
+{
+    for (unsigned j = 0; j < n; j++) {
+        const char *e = names + j * stride;
+        if (e[0] == name[0] && std::strncmp(e, name, max) == 0) {
+            return j;
+        }
+    }
+    return -1;
+}
+
+#ifdef SIMD_X86
+
+// Advances a search for <len> free entries over the 16 entries at <i>, whose
+// free entries are the set bits of <m>. Returns where the run starts once
+// it is long enough, or -1 with <run> and <start> carried to the next chunk.
+static inline int
+run_step(unsigned m, unsigned i, unsigned len, unsigned &run, unsigned &start)
+{
+    if (m == 0xffff) {
+        if (run == 0) {
+            start = i;
+        }
+        run += 16;
+        return run >= len ? (int)start : -1;
+    }
+    // free entries at the bottom extend the current run
+    unsigned lead = __builtin_ctz(~m);
+    if (run == 0) {
+        start = i;
+    }
+    if (run + lead >= len) {
+        return start;
+    }
+    // shorter runs can also fit inside the chunk
+    if (len < 16) {
+        unsigned x = m;
+        for (unsigned j = 1; j < len; j++) {
+            x &= m >> j;
+        }
+        if (x) {
+            return i + __builtin_ctz(x);
+        }
+    }
+    // free entries at the top start a new one
+    run = __builtin_clz((~m & 0xffff) << 16);
+    start = i + 16 - run;
+    return -1;
+}
+
+// scalar continuation of run_step for the tail of the range
+static int
+run_tail(const int16_t *fat, unsigned i, unsigned to, unsigned len,
+         unsigned run, unsigned start)
+{
+    for (; i < to; i++) {
+        if (fat[i] != 0) {
+            run = 0;
+            continue;
+        }
+        if (run++ == 0) {
+            start = i;
+        }
+        if (run >= len) {
+            return start;
+        }
+    }
+    return -1;
+}
+
+// SSE2 is part of x86-64, the 16-bit compares give two mask bits per entry
+
+__attribute__((target("sse2")))
+static int
+find_free_sse2(const int16_t *fat, unsigned from, unsigned to)
+{
+    const __m128i zero = _mm_setzero_si128();
+    unsigned i = from;
+    for (; i + 8 <= to; i += 8) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(fat + i));
+        unsigned m = _mm_movemask_epi8(_mm_cmpeq_epi16(v, zero));
+        if (m) {
+            return i + __builtin_ctz(m) / 2;
+        }
+    }
+    return find_free_scalar(fat, i, to);
+}
+
+// one bit per entry for the 16 entries at <p>
+__attribute__((target("sse2")))
+static inline unsigned
+free_mask_sse2(const int16_t *p)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 8));
+    return _mm_movemask_epi8(_mm_packs_epi16(_mm_cmpeq_epi16(a, zero),
+                                             _mm_cmpeq_epi16(b, zero)));
+}
+
+__attribute__((target("sse2")))
+static int
+find_run_sse2(const int16_t *fat, unsigned from, unsigned to, unsigned len)
+{
+    unsigned run = 0, start = from;
+    unsigned i = from;
+    for (; i + 16 <= to; i += 16) {
+        int found = run_step(free_mask_sse2(fat + i), i, len, run, start);
+        if (found != -1) {
+            return found;
+        }
+    }
+    return run_tail(fat, i, to, len, run, start);
+}
+
+// the compare results are -1 per free entry, subtracting them counts each
+// lane; the 16-bit lanes are folded before they can overflow
+__attribute__((target("sse2")))
+static unsigned
+count_free_sse2(const int16_t *fat, unsigned from, unsigned to)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    unsigned n = 0;
+    unsigned i = from;
+    while (i + 8 <= to) {
+        __m128i acc = _mm_setzero_si128();
+        for (unsigned k = 0; k < 0x4000 && i + 8 <= to; k++, i += 8) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(fat + i));
+            acc = _mm_sub_epi16(acc, _mm_cmpeq_epi16(v, zero));
+        }
+        uint32_t lanes[4];
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), _mm_madd_epi16(acc, ones));
+        n += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+    return n + count_free_scalar(fat, i, to);
+}
+
+// Compares a name as two <W>-byte chunks, one from the start and one ending
+// at its NUL, so names up to 2W - 1 bytes need no further compare. The bytes
+// between the chunks of longer names are compared with memcmp.
+__attribute__((target("sse2")))
+static int
+match_sse2(const char *names, unsigned stride, unsigned max, unsigned n,
+           const char *name, unsigned len)
+{
+    if (stride < 16 || max < 16) {
+        return match_scalar(names, stride, max, n, name, len);
+    }
+    const unsigned size = len + 1;
+    char head[16] = { 0 };
+    std::memcpy(head, name, size < 16 ? size : 16);
+    const __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(head));
+    if (size <= 16) {
+        const unsigned want = (1u << size) - 1;
+        for (unsigned j = 0; j < n; j++) {
+            const char *e = names + j * stride;
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(e));
+            if ((_mm_movemask_epi8(_mm_cmpeq_epi8(v, h)) & want) == want) {
+                return j;
+            }
+        }
+        return -1;
+    }
+    const unsigned tail = size - 16;
+    const __m128i t = _mm_loadu_si128(reinterpret_cast<const __m128i*>(name + tail));
+    for (unsigned j = 0; j < n; j++) {
+        const char *e = names + j * stride;
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(e + tail));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(e));
+        __m128i eq = _mm_and_si128(_mm_cmpeq_epi8(a, t), _mm_cmpeq_epi8(b, h));
+        if (_mm_movemask_epi8(eq) == 0xffff &&
+            (tail <= 16 || std::memcmp(e + 16, name + 16, tail - 16) == 0)) {
+            return j;
+        }
+    }
+    return -1;
+}
+
+__attribute__((target("avx2")))
+static int
+find_free_avx2(const int16_t *fat, unsigned from, unsigned to)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    unsigned i = from;
+    for (; i + 16 <= to; i += 16) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(fat + i));
+        unsigned m = _mm256_movemask_epi8(_mm256_cmpeq_epi16(v, zero));
+        if (m) {
+            return i + __builtin_ctz(m) / 2;
+        }
+    }
+    return find_free_sse2(fat, i, to);
+}
+
+__attribute__((target("avx2")))
+static inline unsigned
+free_mask_avx2(const int16_t *p)
+{
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    __m256i eq = _mm256_cmpeq_epi16(v, _mm256_setzero_si256());
+    return _mm_movemask_epi8(_mm_packs_epi16(_mm256_castsi256_si128(eq),
+                                             _mm256_extracti128_si256(eq, 1)));
+}
+
+__attribute__((target("avx2")))
+static int
+find_run_avx2(const int16_t *fat, unsigned from, unsigned to, unsigned len)
+{
+    unsigned run = 0, start = from;
+    unsigned i = from;
+    for (; i + 16 <= to; i += 16) {
+        int found = run_step(free_mask_avx2(fat + i), i, len, run, start);
+        if (found != -1) {
+            return found;
+        }
+    }
+    return run_tail(fat, i, to, len, run, start);
+}
+
+__attribute__((target("avx2")))
+static unsigned
+count_free_avx2(const int16_t *fat, unsigned from, unsigned to)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(1);
+    unsigned n = 0;
+    unsigned i = from;
+    while (i + 16 <= to) {
+        __m256i acc = _mm256_setzero_si256();
+        for (unsigned k = 0; k < 0x4000 && i + 16 <= to; k++, i += 16) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(fat + i));
+            acc = _mm256_sub_epi16(acc, _mm256_cmpeq_epi16(v, zero));
+        }
+        uint32_t lanes[8];
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), _mm256_madd_epi16(acc, ones));
+        for (int l = 0; l < 8; l++) {
+            n += lanes[l];
+        }
+    }
+    return n + count_free_sse2(fat, i, to);
+}
+
+__attribute__((target("avx2")))
+static int
+match_avx2(const char *names, unsigned stride, unsigned max, unsigned n,
+           const char *name, unsigned len)
+{
+    if (stride < 32 || max < 32) {
+        return match_sse2(names, stride, max, n, name, len);
+    }
+    const unsigned size = len + 1;
+    char head[32] = { 0 };
+    std::memcpy(head, name, size < 32 ? size : 32);
+    const __m256i h = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(head));
+    if (size <= 32) {
+        const unsigned want = size == 32 ? 0xffffffffu : (1u << size) - 1;
+        for (unsigned j = 0; j < n; j++) {
+            const char *e = names + j * stride;
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(e));
+            if (((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, h)) & want) == want) {
+                return j;
+            }
+        }
+        return -1;
+    }
+    const unsigned tail = size - 32;
+    const __m256i t = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(name + tail));
+    for (unsigned j = 0; j < n; j++) {
+        const char *e = names + j * stride;
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(e + tail));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(e));
+        __m256i eq = _mm256_and_si256(_mm256_cmpeq_epi8(a, t), _mm256_cmpeq_epi8(b, h));
+        if ((unsigned)_mm256_movemask_epi8(eq) == 0xffffffffu &&
+            (tail <= 32 || std::memcmp(e + 32, name + 32, tail - 32) == 0)) {
+            return j;
+        }
+    }
+    return -1;
+}
+
+#endif // SIMD_X86
+
+struct simd_kernels {
+    int (*find_free)(const int16_t*, unsigned, unsigned);
+    int (*find_run)(const int16_t*, unsigned, unsigned, unsigned);
+    unsigned (*count_free)(const int16_t*, unsigned, unsigned);
+    int (*match)(const char*, unsigned, unsigned, unsigned, const char*, unsigned);
+};
+
+static const simd_kernels kernels[SIMD_LEVELS] = {
+    { find_free_scalar, find_run_scalar, count_free_scalar, match_scalar },
+#ifdef SIMD_X86
+    { find_free_sse2, find_run_sse2, count_free_sse2, match_sse2 },
+    { find_free_avx2, find_run_avx2, count_free_avx2, match_avx2 },
+#else
+    { find_free_scalar, find_run_scalar, count_free_scalar, match_scalar },
+    { find_free_scalar, find_run_scalar, count_free_scalar, match_scalar },
+#endif
+};
+
+// starts out scalar, so calls made before the selection below are safe
+static std::atomic<int> active(SIMD_SCALAR);
+
+int
+simd_select(int level)
+{
+    int best = SIMD_SCALAR;
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        best = SIMD_SSE2;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        best = SIMD_AVX2;
+    }
+#endif
+    if (level < SIMD_SCALAR) {
+        level = SIMD_SCALAR;
+    }
+    active.store(level < best ? level : best, std::memory_order_relaxed);
+    return simd_active();
+}
+
+int
+simd_active()
+{
+    return active.load(std::memory_order_relaxed);
+}
+
+static const int selected = simd_select();
+
+static const simd_kernels &
+impl()
+{
+    return kernels[active.load(std::memory_order_relaxed)];
+}
+
+int
+fat_find_free(const int16_t *fat, unsigned from, unsigned to)
+{
+    return impl().find_free(fat, from, to);
+}
+
+int
+fat_find_free_run(const int16_t *fat, unsigned from, unsigned to, unsigned len)
+{
+    if (len == 0) {
+        return from <= to ? (int)from : -1;
+    }
+    return impl().find_run(fat, from, to, len);
+}
+
+unsigned
+fat_count_free(const int16_t *fat, unsigned from, unsigned to)
+{
+    return impl().count_free(fat, from, to);
+}
+
+int
+name_match(const char *names, unsigned stride, unsigned max, unsigned n,
+           const char *name)
+{
+    unsigned len = std::strlen(name);
+    // stored names are NUL-terminated, so longer names can never match
+    if (len == 0 || len >= max) {
+        return -1;
+    }
+    return impl().match(names, stride, max, n, name, len);
+}
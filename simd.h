@@ -0,0 +1,37 @@
+#include <cstdint>
+
+#ifndef __SIMD_H__
+#define __SIMD_H__
+
+// Vectorized kernels for the FAT scans and the directory lookup. The widest
+// implementation the CPU supports is picked at startup, the scalar versions
+// are used on other architectures.
+
+enum simd_level {
+    SIMD_SCALAR,
+    SIMD_SSE2,
+    SIMD_AVX2,
+    SIMD_LEVELS
+};
+
+extern const char *simd_level_names[SIMD_LEVELS];
+
+// switches to the widest kernels supported by the CPU, but no wider than
+// <level>, and returns the level now in use
+int simd_select(int level = SIMD_AVX2);
+int simd_active();
+
+// first free (zero) entry in fat[from, to), or -1
+int fat_find_free(const int16_t *fat, unsigned from, unsigned to);
+// start of the first run of <len> free entries in fat[from, to), or -1
+int fat_find_free_run(const int16_t *fat, unsigned from, unsigned to, unsigned len);
+// number of free entries in fat[from, to)
+unsigned fat_count_free(const int16_t *fat, unsigned from, unsigned to);
+
+// index of the entry called <name> among <n> NUL-padded names of at most
+// <max> bytes laid out <stride> bytes apart, or -1. A packed prefix of
+// the name is compared first, the rest only for entries that match it.
+int name_match(const char *names, unsigned stride, unsigned max, unsigned n,
+               const char *name);
+
+#endif // __SIMD_H__
@@ -0,0 +1,74 @@
+#include <fstream>
+#include <chrono>
+#include "span.h"
+
+std::atomic<bool> SpanTracer::enabled(false);
+std::mutex SpanTracer::lock;
+std::vector<span_event> SpanTracer::events;
+std::string SpanTracer::path;
+
+double
+SpanTracer::now_us()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count() / 1000.0;
+}
+
+int
+SpanTracer::thread_id()
+{
+    static std::atomic<int> next_id(1);
+    static thread_local int id = 0;
+    if (id == 0) {
+        id = next_id++;
+    }
+    return id;
+}
+
+void
+SpanTracer::add(const span_event &e)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    events.push_back(e);
+}
+
+int
+SpanTracer::start(const std::string &file)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (enabled) {
+        return -1;
+    }
+    path = file;
+    events.clear();
+    enabled = true;
+    return 0;
+}
+
+int
+SpanTracer::stop()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (!enabled) {
+        return -1;
+    }
+    enabled = false;
+    std::ofstream out(path.c_str());
+    if (!out.is_open()) {
+        return -2;
+    }
+    out.precision(3);
+    out << std::fixed << "{\"traceEvents\":[\n";
+    for (size_t i = 0; i < events.size(); i++) {
+        const span_event &e = events[i];
+        out << (i ? ",\n" : "") << "{\"name\":\"" << e.name;
+        if (e.arg >= 0) {
+            out << " " << e.arg;
+        }
+        out << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << e.tid
+            << ",\"ts\":" << e.start_us << ",\"dur\":" << e.dur_us << "}";
+    }
+    out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+    events.clear();
+    return 0;
+}
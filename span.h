@@ -0,0 +1,62 @@
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+
+#ifndef __SPAN_H__
+#define __SPAN_H__
+
+// set to false to compile span tracing out completely
+#define SPANS true
+
+struct span_event {
+    const char *name;
+    int arg; // block number or -1, appended to the name when written
+    int tid;
+    double start_us;
+    double dur_us;
+};
+
+// Collects spans and writes them as a Chrome trace (JSON) that opens in
+// Perfetto or chrome://tracing. Spans on the same thread nest by time.
+class SpanTracer {
+private:
+    static std::mutex lock;
+    static std::vector<span_event> events;
+    static std::string path;
+public:
+    static std::atomic<bool> enabled;
+    static double now_us();
+    static int thread_id();
+    static void add(const span_event &e);
+    // start collecting spans, they are written to <file> by stop()
+    static int start(const std::string &file);
+    static int stop();
+};
+
+// Records the time from construction to destruction as one span. When
+// tracing is off this is a single branch on a relaxed load.
+class Span {
+private:
+    span_event e;
+    bool active;
+public:
+    Span(const char *name, int arg = -1)
+        : active(SPANS && SpanTracer::enabled.load(std::memory_order_relaxed)) {
+        if (active) {
+            e.name = name;
+            e.arg = arg;
+            e.start_us = SpanTracer::now_us();
+        }
+    }
+    ~Span() {
+        if (active) {
+            e.dur_us = SpanTracer::now_us() - e.start_us;
+            e.tid = SpanTracer::thread_id();
+            SpanTracer::add(e);
+        }
+    }
+};
+
+#endif // __SPAN_H__
@@ -0,0 +1,116 @@
+#include "stats.h"
+
+const char *block_class_names[BLK_CLASSES] = { "dir", "fat", "data" };
+
+void
+IOStats::call(trace_op op, uint64_t us)
+{
+    int b = 0;
+    while (us > 1 && b < LATENCY_BUCKETS - 1) {
+        us >>= 1;
+        b++;
+    }
+    add(calls[op], 1);
+    add(latency[op][b], 1);
+}
+
+void
+IOStats::snapshot(fs_stats &s)
+{
+    for (int c = 0; c < BLK_CLASSES; c++) {
+        s.reads[c] = reads[c];
+        s.writes[c] = writes[c];
+    }
+    s.bytes_read = bytes_read;
+    s.bytes_written = bytes_written;
+    s.bytes_deduped = bytes_deduped;
+    s.flushes = flushes;
+    s.discards = discards;
+    // the checksum counters live in the Disk, FS::stats fills them in
+    s.verified = s.checksum_errors = 0;
+    s.allocs = allocs;
+    s.alloc_scanned = alloc_scanned;
+    s.block_hits = block_hits;
+    s.block_misses = block_misses;
+    s.readahead = readahead_blocks;
+    s.written_back = written_back_blocks;
+    s.throttled = throttle_waits;
+    for (int op = 0; op < OP_COUNT; op++) {
+        s.calls[op] = calls[op];
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            s.latency[op][b] = latency[op][b];
+        }
+    }
+}
+
+void
+IOStats::reset()
+{
+    for (int c = 0; c < BLK_CLASSES; c++) {
+        reads[c] = 0;
+        writes[c] = 0;
+    }
+    bytes_read = bytes_written = bytes_deduped = 0;
+    flushes = 0;
+    discards = 0;
+    allocs = alloc_scanned = 0;
+    block_hits = block_misses = readahead_blocks = 0;
+    written_back_blocks = throttle_waits = 0;
+    for (int op = 0; op < OP_COUNT; op++) {
+        calls[op] = 0;
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            latency[op][b] = 0;
+        }
+    }
+}
+
+uint64_t
+latency_percentile(const uint64_t *hist, double p)
+{
+    uint64_t total = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        total += hist[b];
+    }
+    uint64_t seen = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += hist[b];
+        if (total > 0 && seen >= p * total) {
+            return 2ull << b;
+        }
+    }
+    return 0;
+}
+
+void
+print_stats(std::ostream &out, const fs_stats &s)
+{
+    out << "blocks      read     written\n";
+    for (int c = 0; c < BLK_CLASSES; c++) {
+        out << block_class_names[c] << "\t" << s.reads[c] << "\t" << s.writes[c] << "\n";
+    }
+    out << "bytes read " << s.bytes_read << ", written " << s.bytes_written
+        << ", deduplicated " << s.bytes_deduped << "\n";
+    out << "flushes " << s.flushes << ", blocks discarded " << s.discards << "\n";
+    out << "checksums verified " << s.verified << ", errors " << s.checksum_errors << "\n";
+    out << "allocs " << s.allocs << ", FAT entries scanned " << s.alloc_scanned << "\n";
+    out << "block cache hits " << s.block_hits << ", misses " << s.block_misses
+        << ", read ahead " << s.readahead << "\n";
+    out << "blocks written back " << s.written_back << ", writers throttled " << s.throttled << "\n";
+    out << "op\tcalls\tp50<us\tp99<us\thistogram (log2 us buckets)\n";
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (s.calls[op] == 0) {
+            continue;
+        }
+        out << trace_op_names[op] << "\t" << s.calls[op] << "\t"
+            << latency_percentile(s.latency[op], 0.50) << "\t"
+            << latency_percentile(s.latency[op], 0.99) << "\t";
+        int last = LATENCY_BUCKETS - 1;
+        while (last > 0 && s.latency[op][last] == 0) {
+            last--;
+        }
+        for (int b = 0; b <= last; b++) {
+            out << (b ? " " : "") << s.latency[op][b];
+        }
+        out << "\n";
+    }
+}
@@ -0,0 +1,108 @@
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include "trace.h"
+#include "span.h"
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+// kinds of blocks the I/O counters are split by
+enum block_class { BLK_DIR, BLK_FAT, BLK_DATA, BLK_CLASSES };
+
+extern const char *block_class_names[BLK_CLASSES];
+
+// bucket i of a latency histogram counts calls that took less than 2^(i+1)
+// microseconds (and at least 2^i, except for bucket 0)
+#define LATENCY_BUCKETS 24
+
+// a snapshot of the counters in IOStats
+struct fs_stats {
+    uint64_t reads[BLK_CLASSES]; // blocks read
+    uint64_t writes[BLK_CLASSES]; // blocks written
+    uint64_t bytes_read; // file data handed out by cat, cp and append
+    uint64_t bytes_written; // file data stored by create, cp and append
+    uint64_t bytes_deduped; // file data that shares blocks instead
+    uint64_t flushes; // FAT or directory blocks written back
+    uint64_t discards; // freed blocks punched out of the image file
+    uint64_t verified; // blocks read whose checksum was checked
+    uint64_t checksum_errors; // blocks read that did not match it
+    uint64_t allocs; // blocks allocated
+    uint64_t alloc_scanned; // FAT entries looked at by the allocator
+    uint64_t block_hits; // data block reads served by the block cache
+    uint64_t block_misses; // data block reads that went to the disk
+    uint64_t readahead; // blocks read ahead into the block cache
+    uint64_t written_back; // dirty blocks written back from the cache
+    uint64_t throttled; // times a writer waited for the write-back
+    uint64_t calls[OP_COUNT];
+    uint64_t latency[OP_COUNT][LATENCY_BUCKETS];
+};
+
+// Always-on counters of what the FS does. They are relaxed atomics, so
+// updating them costs an uncontended add and they may be read at any time.
+class IOStats {
+private:
+    std::atomic<uint64_t> reads[BLK_CLASSES];
+    std::atomic<uint64_t> writes[BLK_CLASSES];
+    std::atomic<uint64_t> bytes_read;
+    std::atomic<uint64_t> bytes_written;
+    std::atomic<uint64_t> bytes_deduped;
+    std::atomic<uint64_t> flushes;
+    std::atomic<uint64_t> discards;
+    std::atomic<uint64_t> allocs;
+    std::atomic<uint64_t> alloc_scanned;
+    std::atomic<uint64_t> block_hits;
+    std::atomic<uint64_t> block_misses;
+    std::atomic<uint64_t> readahead_blocks;
+    std::atomic<uint64_t> written_back_blocks;
+    std::atomic<uint64_t> throttle_waits;
+    std::atomic<uint64_t> calls[OP_COUNT];
+    std::atomic<uint64_t> latency[OP_COUNT][LATENCY_BUCKETS];
+    static void add(std::atomic<uint64_t> &c, uint64_t n) {
+        c.fetch_add(n, std::memory_order_relaxed);
+    }
+public:
+    IOStats() { reset(); }
+    void read(block_class c) { add(reads[c], 1); }
+    void write(block_class c) { add(writes[c], 1); }
+    void data_read(uint64_t n) { add(bytes_read, n); }
+    void data_written(uint64_t n) { add(bytes_written, n); }
+    void data_deduped(uint64_t n) { add(bytes_deduped, n); }
+    void flush() { add(flushes, 1); }
+    void discard(uint64_t n) { add(discards, n); }
+    void alloc(uint64_t scanned) { add(allocs, 1); add(alloc_scanned, scanned); }
+    void block_hit() { add(block_hits, 1); }
+    void block_miss() { add(block_misses, 1); }
+    void readahead(uint64_t n) { add(readahead_blocks, n); }
+    void written_back(uint64_t n) { add(written_back_blocks, n); }
+    void throttled() { add(throttle_waits, 1); }
+    void call(trace_op op, uint64_t us);
+    void snapshot(fs_stats &s);
+    void reset();
+};
+
+// adds the time from construction to destruction to the histogram of <op>,
+// and to the span trace when that is enabled
+class OpTimer {
+private:
+    IOStats &stats;
+    trace_op op;
+    std::chrono::steady_clock::time_point start;
+    Span span;
+public:
+    OpTimer(IOStats &stats, trace_op op)
+        : stats(stats), op(op), start(std::chrono::steady_clock::now()),
+          span(trace_op_names[op]) {}
+    ~OpTimer() {
+        stats.call(op, std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count());
+    }
+};
+
+// upper bound in microseconds of the bucket holding the <p> quantile
+uint64_t latency_percentile(const uint64_t *hist, double p);
+// prints a snapshot in the format of the shell's stats command
+void print_stats(std::ostream &out, const fs_stats &s);
+
+#endif // __STATS_H__
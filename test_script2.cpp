@@ -52,7 +52,6 @@ Shell::run()
 {
     std::string cmd, arg1, arg2;
     int ret_val = 0;
-    int fd[2];
     int fw;
     std::string input1 = "hej heja hejare\n";
     std::string input2 = "hej heja hejare hejast\n";
@@ -52,7 +52,6 @@ Shell::run()
 {
     std::string cmd, arg1, arg2;
     int ret_val = 0;
-    int fd[2];
     int fw;
     std::string input1 = "hej heja hejare\n";
     std::string input2 = "hej heja hejare hejast\n";
@@ -102,7 +101,11 @@ Shell::run()
     std::cout << "f2\t file\t 23" << std::endl;
     std::cout << "Actual output:" << std::endl;
     ret_val = filesystem.pwd();
+    if (ret_val)
+        std::cout << "Error: pwd failed, error code " << ret_val << std::endl;
     ret_val = filesystem.ls();
+    if (ret_val)
+        std::cout << "Error: ls failed, error code " << ret_val << std::endl;
     PRINTDIV2;
     */
 
@@ -190,7 +193,11 @@ Shell::run()
     std::cout << "f4\t file\t 23" << std::endl;
     std::cout << "Actual output:" << std::endl;
     ret_val = filesystem.pwd();
+    if (ret_val)
+        std::cout << "Error: pwd failed, error code " << ret_val << std::endl;
     ret_val = filesystem.ls();
+    if (ret_val)
+        std::cout << "Error: ls failed, error code " << ret_val << std::endl;
     PRINTDIV2;
 
     std::cout << "... Task 4 done" << std::endl;
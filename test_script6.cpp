@@ -0,0 +1,243 @@
+// Regression tests for the extensions to the file system: delayed
+// allocation, compression and the reservations they make, sparse files,
+// deduplication, batches, preallocation and write-back.
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include "test_script.h"
+#include "fs.h"
+
+#define PRINTDIV std::cout <<  "================================================================================" << std::endl
+#define PRINTDIV2 std::cout << "----------------------------------------" << std::endl
+
+std::string commands_str[] = {
+    "format", "create", "cat", "ls",
+    "cp", "mv", "rm", "append",
+    "mkdir", "cd", "pwd",
+    "chmod",
+    "help", "quit"
+};
+
+Shell::Shell()
+{
+    std::cout << "Creating and starting shell...\n";
+}
+
+Shell::~Shell()
+{
+    std::cout << "Exiting shell...\n";
+}
+
+// <size> bytes that no chunk of the compressor can shrink
+static std::string
+noise(uint32_t size)
+{
+    std::string data(size, '\0');
+    uint32_t x = 12345;
+    for (uint32_t i = 0; i < size; i++) {
+        x = x * 1103515245 + 12345;
+        data[i] = static_cast<char>(x >> 16);
+    }
+    return data;
+}
+
+// what a second mount of the image reads from <name>: its size, or -2 if
+// the file is not there, with the content in <out>
+static int
+remount_read(const char *name, std::string &out)
+{
+    FS fresh(false);
+    fs_stat st;
+    int ret = fresh.stat(name, st);
+    if (ret != 0) {
+        return ret;
+    }
+    out.assign(st.size, '\0');
+    return fresh.read(name, &out[0], st.size);
+}
+
+void
+Shell::run()
+{
+    int ret_val = 0;
+
+    PRINTDIV;
+    std::cout << "\\ / \\ / \\ / \\ / \\ / \\ / \\     new test session     / \\ / \\ / \\ / \\ / \\ / \\ / \\ /" << std::endl;
+    PRINTDIV;
+    std::cout << "Starting test sequence..." << std::endl;
+    PRINTDIV;
+    std::cout << "Task 6 ..." << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Testing delayed compressed files that do not shrink..." << std::endl;
+    std::cout << "Each file is one byte short of 31 blocks, its chunk table makes it 32." << std::endl;
+    std::cout << "Starting with empty disk..." << std::endl;
+    filesystem.format();
+    filesystem.set_delayed(true);
+    filesystem.set_compression(true);
+    std::string data = noise(31 * BLOCK_SIZE - 1);
+    int created = 0;
+    for (int k = 0; k < 64; k++) {
+        std::ostringstream name;
+        name << "z" << k;
+        ret_val = filesystem.create(name.str(), data.data(), data.size());
+        if (ret_val) {
+            break;
+        }
+        created++;
+    }
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "created 63 files, then error code -5" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << "created " << created << " files, then error code " << ret_val << std::endl;
+
+    std::cout << "--------\nEvery created file reaches the disk intact..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "sync 0, 63 files intact" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    ret_val = filesystem.sync();
+    int intact = 0;
+    std::vector<char> buf(data.size());
+    for (int k = 0; k < created; k++) {
+        std::ostringstream name;
+        name << "z" << k;
+        if (filesystem.read(name.str().c_str(), buf.data(), buf.size()) == (int)data.size() &&
+            std::memcmp(buf.data(), data.data(), data.size()) == 0) {
+            intact++;
+        }
+    }
+    std::cout << "sync " << ret_val << ", " << intact << " files intact" << std::endl;
+
+    std::cout << "--------\nThe same with a file just under one block..." << std::endl;
+    filesystem.format();
+    std::string small = noise(BLOCK_SIZE - 1);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "create 0, sync 0, read " << small.size() << " intact" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    int c = filesystem.create("s", small.data(), small.size());
+    int s = filesystem.sync();
+    int n = filesystem.read("s", buf.data(), buf.size());
+    std::cout << "create " << c << ", sync " << s << ", read " << n
+              << (n == (int)small.size() && std::memcmp(buf.data(), small.data(), n) == 0 ? " intact" : " corrupt")
+              << std::endl;
+    filesystem.set_compression(false);
+    filesystem.set_delayed(false);
+
+    std::cout << "--------\nTesting a sparse file..." << std::endl;
+    std::cout << "Four blocks, the middle two all zeros, become two blocks and a hole." << std::endl;
+    filesystem.format();
+    std::string sparse(4 * BLOCK_SIZE, '\0');
+    sparse[0] = 'x';
+    sparse[sparse.size() - 1] = 'y';
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "create 0, size " << 4 * BLOCK_SIZE << ", allocated " << 2 * BLOCK_SIZE
+              << ", read " << 4 * BLOCK_SIZE << " intact" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    c = filesystem.create("h", sparse.data(), sparse.size());
+    fs_stat st;
+    filesystem.stat("h", st);
+    n = filesystem.read("h", buf.data(), buf.size());
+    std::cout << "create " << c << ", size " << st.size << ", allocated " << st.allocated
+              << ", read " << n
+              << (n == (int)sparse.size() && std::memcmp(buf.data(), sparse.data(), n) == 0 ? " intact" : " corrupt")
+              << std::endl;
+
+    std::cout << "--------\nTesting copy-on-write of deduplicated files..." << std::endl;
+    std::cout << "d1 and d2 share a chain until d2 is appended to. d3 then shares d1's chain," << std::endl;
+    std::cout << "rm d1 leaves d3 and d2 intact." << std::endl;
+    filesystem.format();
+    filesystem.set_dedup(true);
+    std::string shared = noise(2 * BLOCK_SIZE);
+    filesystem.create("d1", shared.data(), shared.size());
+    filesystem.create("d2", shared.data(), shared.size());
+    filesystem.create("tail", "tail", 4);
+    fs_stat st1, st2;
+    filesystem.stat("d1", st1);
+    filesystem.stat("d2", st2);
+    bool same = st1.first_blk == st2.first_blk;
+    int a = filesystem.append("tail", "d2");
+    filesystem.stat("d1", st1);
+    filesystem.stat("d2", st2);
+    bool split = st1.first_blk != st2.first_blk;
+    filesystem.create("d3", shared.data(), shared.size());
+    int r = filesystem.rm("d1");
+    int n3 = filesystem.read("d3", buf.data(), buf.size());
+    bool intact3 = n3 == (int)shared.size() && std::memcmp(buf.data(), shared.data(), n3) == 0;
+    n = filesystem.read("d2", buf.data(), buf.size());
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "shared 1, append 0, split 1, rm 0, d3 " << shared.size() << " intact, d2 "
+              << shared.size() + 4 << " intact" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << "shared " << same << ", append " << a << ", split " << split << ", rm " << r
+              << ", d3 " << n3 << (intact3 ? " intact" : " corrupt") << ", d2 " << n
+              << (n == (int)shared.size() + 4 && std::memcmp(buf.data(), shared.data(), shared.size()) == 0 &&
+                  std::memcmp(buf.data() + shared.size(), "tail", 4) == 0 ? " intact" : " corrupt")
+              << std::endl;
+    filesystem.set_dedup(false);
+
+    std::cout << "--------\nTesting a batch..." << std::endl;
+    std::cout << "A second mount sees none of the batch before commit, and all of it after." << std::endl;
+    filesystem.format();
+    filesystem.create("keep", "old", 3);
+    filesystem.begin();
+    filesystem.create("b1", "new", 3);
+    filesystem.rm("keep");
+    std::string got;
+    int keep = remount_read("keep", got);
+    int b1 = remount_read("b1", got);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "before commit: keep 3, b1 -2" << std::endl;
+    std::cout << "commit 0, after: keep -2, b1 3 new" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << "before commit: keep " << keep << ", b1 " << b1 << std::endl;
+    c = filesystem.commit();
+    keep = remount_read("keep", got);
+    b1 = remount_read("b1", got);
+    std::cout << "commit " << c << ", after: keep " << keep << ", b1 " << b1 << " " << got << std::endl;
+
+    std::cout << "--------\nTesting append into preallocated blocks..." << std::endl;
+    std::cout << "fallocate reserves 8 blocks, appending 3 blocks uses them and allocates nothing." << std::endl;
+    filesystem.format();
+    std::string chunk = noise(3 * BLOCK_SIZE);
+    filesystem.create("part", chunk.data(), chunk.size());
+    int f = filesystem.fallocate("pre", 8 * BLOCK_SIZE);
+    fs_stat before, after;
+    filesystem.stat("pre", before);
+    a = filesystem.append("part", "pre");
+    filesystem.stat("pre", after);
+    n = filesystem.read("pre", buf.data(), buf.size());
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "fallocate 0, size 0, allocated " << 8 * BLOCK_SIZE << ", append 0, size "
+              << chunk.size() << ", allocated " << 8 * BLOCK_SIZE << ", same chain 1, read "
+              << chunk.size() << " intact" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << "fallocate " << f << ", size " << before.size << ", allocated " << before.allocated
+              << ", append " << a << ", size " << after.size << ", allocated " << after.allocated
+              << ", same chain " << (before.first_blk == after.first_blk) << ", read " << n
+              << (n == (int)chunk.size() && std::memcmp(buf.data(), chunk.data(), n) == 0 ? " intact" : " corrupt")
+              << std::endl;
+
+    std::cout << "--------\nTesting sync with write-back on..." << std::endl;
+    std::cout << "After sync a second mount reads the data the cache held." << std::endl;
+    filesystem.format();
+    filesystem.set_writeback(true);
+    std::string cached = noise(5 * BLOCK_SIZE);
+    c = filesystem.create("wb", cached.data(), cached.size());
+    s = filesystem.sync();
+    n = remount_read("wb", got);
+    filesystem.set_writeback(false);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "create 0, sync 0, remount read " << cached.size() << " intact" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << "create " << c << ", sync " << s << ", remount read " << n
+              << (got == cached ? " intact" : " corrupt") << std::endl;
+
+    PRINTDIV2;
+
+    std::cout << "... Task 6 done" << std::endl;
+    PRINTDIV;
+}
@@ -0,0 +1,194 @@
+#include <cstring>
+#include <cstdlib>
+#include <sstream>
+#include "trace.h"
+
+const char *trace_op_names[OP_COUNT] = {
+    "format", "create", "cat", "ls",
+    "cp", "mv", "rm", "append",
+    "mkdir", "cd", "pwd", "chmod",
+    "begin", "commit", "fallocate", "advise",
+    "stat", "read", "readdir", "sync"
+};
+
+TraceRecorder::TraceRecorder() : last_us(0)
+{
+}
+
+TraceRecorder::~TraceRecorder()
+{
+    close();
+}
+
+int
+TraceRecorder::open(const std::string &path)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (out.is_open()) {
+        return -1;
+    }
+    out.open(path.c_str(), std::ios::binary | std::ios::out | std::ios::trunc);
+    if (!out.is_open()) {
+        return -2;
+    }
+    out.write(TRACE_MAGIC, std::strlen(TRACE_MAGIC));
+    start = std::chrono::steady_clock::now();
+    last_us = 0;
+    return 0;
+}
+
+void
+TraceRecorder::close()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (out.is_open()) {
+        out.close();
+    }
+}
+
+void
+TraceRecorder::put_varint(uint64_t v)
+{
+    while (v >= 0x80) {
+        out.put(static_cast<char>(v | 0x80));
+        v >>= 7;
+    }
+    out.put(static_cast<char>(v));
+}
+
+void
+TraceRecorder::put_string(const std::string &s)
+{
+    size_t n = s.size() > 255 ? 255 : s.size();
+    out.put(static_cast<char>(n));
+    out.write(s.data(), n);
+}
+
+void
+TraceRecorder::record(trace_op op, const std::string &arg1,
+                      const std::string &arg2, uint32_t size)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (!out.is_open()) {
+        return;
+    }
+    uint64_t now = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    put_varint(now - last_us);
+    out.put(static_cast<char>(op));
+    put_varint(size);
+    put_string(arg1);
+    put_string(arg2);
+    last_us = now;
+}
+
+static bool
+get_varint(std::istream &in, uint64_t &v)
+{
+    v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = in.get();
+        if (c == EOF) {
+            return false;
+        }
+        v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool
+get_string(std::istream &in, std::string &s)
+{
+    int n = in.get();
+    if (n == EOF) {
+        return false;
+    }
+    s.resize(n);
+    in.read(&s[0], n);
+    return in.gcount() == n;
+}
+
+static int
+read_binary(std::istream &in, std::vector<trace_record> &records)
+{
+    uint64_t time_us = 0;
+    uint64_t delta, size;
+    while (get_varint(in, delta)) {
+        trace_record r;
+        int op = in.get();
+        if (op == EOF || op >= OP_COUNT || !get_varint(in, size) ||
+            !get_string(in, r.arg1) || !get_string(in, r.arg2)) {
+            return -3;
+        }
+        time_us += delta;
+        r.op = op;
+        r.time_us = time_us;
+        r.size = size;
+        records.push_back(r);
+    }
+    return 0;
+}
+
+static int
+read_text(std::istream &in, std::vector<trace_record> &records)
+{
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.compare(0, 2, "//") == 0) {
+            continue;
+        }
+        std::istringstream words(line);
+        std::string cmd;
+        if (!(words >> cmd)) {
+            continue;
+        }
+        trace_record r;
+        r.op = OP_COUNT;
+        for (int op = 0; op < OP_COUNT; op++) {
+            if (cmd == trace_op_names[op]) {
+                r.op = op;
+            }
+        }
+        if (r.op == OP_COUNT) {
+            // help, quit and unknown commands do not reach the FS
+            continue;
+        }
+        words >> r.arg1 >> r.arg2;
+        if (r.op == OP_CREATE) {
+            std::string data;
+            while (std::getline(in, data) && !data.empty()) {
+                r.data += data;
+                r.data += '\n';
+            }
+        }
+        r.time_us = 0;
+        r.size = r.data.size();
+        if (r.op == OP_FALLOCATE) {
+            r.size = std::strtoul(r.arg2.c_str(), nullptr, 10);
+            r.arg2.clear();
+        }
+        records.push_back(r);
+    }
+    return 0;
+}
+
+int
+read_trace(const std::string &path, std::vector<trace_record> &records)
+{
+    std::ifstream in(path.c_str(), std::ios::binary);
+    if (!in.is_open()) {
+        return -1;
+    }
+    char magic[sizeof(TRACE_MAGIC) - 1];
+    in.read(magic, sizeof(magic));
+    if (in.gcount() == (std::streamsize)sizeof(magic) &&
+        std::memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0) {
+        return read_binary(in, records);
+    }
+    in.clear();
+    in.seekg(0);
+    return read_text(in, records);
+}
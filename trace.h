@@ -0,0 +1,63 @@
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <mutex>
+#include <chrono>
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+// FS calls that can be recorded and replayed
+enum trace_op {
+    OP_FORMAT, OP_CREATE, OP_CAT, OP_LS,
+    OP_CP, OP_MV, OP_RM, OP_APPEND,
+    OP_MKDIR, OP_CD, OP_PWD, OP_CHMOD,
+    OP_BEGIN, OP_COMMIT, OP_FALLOCATE, OP_ADVISE,
+    OP_STAT, OP_READ, OP_READDIR, OP_SYNC,
+    OP_COUNT
+};
+
+extern const char *trace_op_names[OP_COUNT];
+
+struct trace_record {
+    uint8_t op;
+    uint64_t time_us; // microseconds since the recording started
+    uint32_t size; // bytes of data written by create, reserved by fallocate, asked for by read
+    std::string arg1;
+    std::string arg2;
+    std::string data; // content for create, only known for text traces
+};
+
+// Appends FS calls to a binary trace file. The file starts with the magic
+// TRACE_MAGIC followed by one record per call:
+//   varint  time since the previous record in microseconds
+//   u8      op
+//   varint  size
+//   u8 len, bytes   arg1
+//   u8 len, bytes   arg2
+#define TRACE_MAGIC "FSTRACE1"
+
+class TraceRecorder {
+private:
+    std::ofstream out;
+    std::mutex lock;
+    std::chrono::steady_clock::time_point start;
+    uint64_t last_us;
+    void put_varint(uint64_t v);
+    void put_string(const std::string &s);
+public:
+    TraceRecorder();
+    ~TraceRecorder();
+    int open(const std::string &path);
+    void close();
+    bool is_open() { return out.is_open(); }
+    void record(trace_op op, const std::string &arg1 = "",
+                const std::string &arg2 = "", uint32_t size = 0);
+};
+
+// Reads a binary trace, or a command script in the format of
+// test_commands.txt (// comments, create data ended by an empty line).
+int read_trace(const std::string &path, std::vector<trace_record> &records);
+
+#endif // __TRACE_H__